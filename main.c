@@ -3,12 +3,39 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h> /* for htonl */
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #define X_SOCKET_PATH "/tmp/.X11-unix/X0"
 
+/* requests are queued here and sent in one go by X_flush */
+#define X_OUT_BUF_SIZE 65536
+
+/* replies and events are read through this, so most reads cost no syscall */
+#define X_IN_BUF_SIZE 65536
+
+#define X_SPRITE_NONE ((size_t)-1)
+
+/* valuators of an XInput2 pointer sample beyond this many are dropped */
+#define X_XI_VALUATORS 8
+
+/*
+Build with -DX_HEADLESS to run the drawing and window API against an in-process
+32bpp framebuffer instead of a server: X_flush executes the queued requests itself.
+*/
+#ifdef X_HEADLESS
+#ifndef X_HEADLESS_WIDTH
+#define X_HEADLESS_WIDTH 1024
+#endif
+#ifndef X_HEADLESS_HEIGHT
+#define X_HEADLESS_HEIGHT 768
+#endif
+/* outside the range of ids handed to the client */
+#define X_HEADLESS_ROOT 0x00000100
+#endif
+
 /* number of bytes needed to round x up to a multiple of four.*/
 #define X_NET_PAD(x) (4 - (x % 4)) % 4
 
@@ -17,6 +44,7 @@ typedef uint32_t X_Window;
 typedef uint32_t X_Colormap;
 typedef uint8_t X_Keycode;
 typedef uint32_t X_Set_of_Event;
+typedef uint32_t X_Keysym;
 
 enum X_Bool {
     True,
@@ -72,6 +100,140 @@ enum X_Window_Class {
     X_WIN_CLASS_COPY_FROM_PARENT
 };
 
+/* value-mask bits of CreateWindow and ChangeWindowAttributes */
+enum X_Win_attr {
+    X_WIN_ATTR_BACKGROUND_PIXMAP = 0x0001,
+    X_WIN_ATTR_BACKGROUND_PIXEL = 0x0002,
+    X_WIN_ATTR_BORDER_PIXMAP = 0x0004,
+    X_WIN_ATTR_BORDER_PIXEL = 0x0008,
+    X_WIN_ATTR_BIT_GRAVITY = 0x0010,
+    X_WIN_ATTR_WIN_GRAVITY = 0x0020,
+    X_WIN_ATTR_BACKING_STORE = 0x0040,
+    X_WIN_ATTR_BACKING_PLANES = 0x0080,
+    X_WIN_ATTR_BACKING_PIXEL = 0x0100,
+    X_WIN_ATTR_OVERRIDE_REDIRECT = 0x0200,
+    X_WIN_ATTR_SAVE_UNDER = 0x0400,
+    X_WIN_ATTR_EVENT_MASK = 0x0800,
+    X_WIN_ATTR_DO_NOT_PROPAGATE_MASK = 0x1000,
+    X_WIN_ATTR_COLORMAP = 0x2000,
+    X_WIN_ATTR_CURSOR = 0x4000
+};
+
+/* value-mask bits of ConfigureWindow */
+enum X_Config {
+    X_CONFIG_X = 0x01,
+    X_CONFIG_Y = 0x02,
+    X_CONFIG_WIDTH = 0x04,
+    X_CONFIG_HEIGHT = 0x08,
+    X_CONFIG_BORDER_WIDTH = 0x10,
+    X_CONFIG_SIBLING = 0x20,
+    X_CONFIG_STACK_MODE = 0x40
+};
+
+/*
+The LISTofVALUE of CreateWindow, ChangeWindowAttributes and ConfigureWindow.
+Values are kept packed in the order of their mask bits, so a filled list can be copied
+into any number of requests as is.
+*/
+struct X_Value_list {
+    uint32_t mask;
+    size_t values_len;
+    uint32_t values[15];
+};
+
+/* a KeyPress or KeyRelease event translated through the keyboard table */
+struct X_Key {
+    X_Keycode keycode;
+    X_Keysym keysym;
+    uint16_t state;     /* SETofKEYBUTMASK at the time of the event */
+    uint8_t modifiers;  /* modifiers the key itself is bound to, 0 for ordinary keys */
+};
+
+/*
+One XI_Motion or XI_RawMotion event. Coordinates and valuators keep their sub-pixel
+precision; for raw events the valuators are the unaccelerated device values and x, y are
+valuators 0 and 1.
+*/
+struct X_Pointer_sample {
+    uint32_t time; /* server time in ms */
+    uint16_t deviceid;
+    uint16_t sourceid;
+    uint8_t raw;
+    X_Window event; /* 0 for raw events */
+    double x;
+    double y;
+    uint32_t valuators_mask; /* bit i set if valuators[i] was reported */
+    double valuators[X_XI_VALUATORS];
+};
+
+/*
+Single-producer single-consumer ring: the thread reading the connection pushes,
+one application thread drains. head and tail only ever grow, cap is a power of two.
+When full, new samples are dropped and counted; overflows counts how many times it filled up.
+*/
+struct X_Pointer_ring {
+    size_t cap;
+    struct X_Pointer_sample * samples;
+
+    size_t head;
+    size_t tail;
+
+    size_t dropped;
+    size_t overflows;
+    uint8_t overflowing;
+};
+
+#ifdef X_HEADLESS
+enum X_Headless_type {
+    X_HEADLESS_WINDOW,
+    X_HEADLESS_PIXMAP,
+    X_HEADLESS_GC
+};
+
+struct X_Headless_resource {
+    X_id id; /* 0 marks a free slot */
+    enum X_Headless_type type;
+
+    /* windows */
+    X_Window parent;
+    int16_t pos_x;
+    int16_t pos_y;
+    uint16_t border_width;
+    uint8_t mapped;
+    uint8_t override_redirect;
+    uint32_t background;
+    X_Set_of_Event event_mask;
+    /* siblings are linked bottom-to-top in stacking order, like in the window cache */
+    X_Window first_child;
+    X_Window last_child;
+    X_Window prev_sibling;
+    X_Window next_sibling;
+
+    /* windows and pixmaps, rows are width pixels apart */
+    uint16_t width;
+    uint16_t height;
+    uint32_t * pixels;
+
+    /* GCs */
+    uint32_t foreground;
+};
+#endif
+
+struct X_Rect {
+    int16_t pos_x;
+    int16_t pos_y;
+    uint16_t width;
+    uint16_t height;
+};
+
+struct X_Image {
+    uint16_t width;
+    uint16_t height;
+    struct X_Pixel_format * format; /* NULL for the default screen's root visual */
+    unsigned char * data; /* ZPixmap in format, rows X_image_stride bytes apart */
+    uint64_t hash;        /* X_image_hash of the above, 0 until computed */
+};
+
 struct X_Visual_type {
     X_id visual_id;
     enum X_Visual_type_Class class;
@@ -151,11 +313,93 @@ struct X_Setup_success_reply {
     X_Keycode max_keycode;
 };
 
+/*
+A visual of one screen together with what it takes to produce its pixels: the pixmap
+format of its depth and, for TrueColor and DirectColor, tables mapping 8-bit components
+to pixel bits, so a pixel is red[r] | green[g] | blue[b].
+*/
+struct X_Pixel_format {
+    size_t screen;
+    X_Window root;
+    uint8_t depth;
+    uint8_t bits_per_px;
+    uint8_t scanline_pad;
+    struct X_Visual_type visual;
+    X_Colormap colormap;
+
+    uint32_t red[256];
+    uint32_t green[256];
+    uint32_t blue[256];
+};
+
+enum X_Map_state {
+    X_MAP_STATE_UNMAPPED,
+    X_MAP_STATE_UNVIEWABLE,
+    X_MAP_STATE_VIEWABLE
+};
+
+struct X_Window_attrs {
+    X_Window wid;
+    X_Window parent;
+    int16_t pos_x;
+    int16_t pos_y;
+    uint16_t width;
+    uint16_t height;
+    uint16_t border_width;
+    enum X_Map_state map_state;
+    uint8_t override_redirect;
+    X_Set_of_Event event_mask;
+    X_Set_of_Event do_not_propagate_mask;
+};
+
+/*
+Client-side copy of a window we created or watch (see X_window_cache_watch), kept up to date
+from the StructureNotify events the server sends for it. Siblings are linked bottom-to-top in stacking order, so QueryTree
+can be answered by walking first_child..next_sibling.
+*/
+struct X_Window_cache_entry {
+    struct X_Window_attrs attrs; /* attrs.wid == 0 marks a free slot */
+    uint8_t mapped;
+
+    /* until an event for it shows the server made it, an error for create_seq drops it */
+    uint8_t create_pending;
+    uint16_t create_seq;
+
+    X_Window first_child;
+    X_Window last_child;
+    X_Window prev_sibling;
+    X_Window next_sibling;
+};
+
 struct X {
     int sock;
 
+    /* every screen of the display, the root_wid and X_rgb shortcuts are for default_screen */
+    size_t screens_len;
+    struct X_Screen * screens;
+    struct X_Pixel_format * screen_formats; /* the root visual of each screen */
+    size_t default_screen;
     X_id root_wid;
-    struct X_Visual_type root_visual;
+
+    size_t pixmap_formats_len;
+    struct X_Pixmap_format * pixmap_formats;
+
+    /*
+    Windows created through this connection are indexed by the allocation number of
+    their id (see X_alloc_id), so lookups never search.
+    */
+    size_t windows_cap;
+    struct X_Window_cache_entry * windows;
+
+    /*
+    Windows of other clients watched with X_window_cache_watch. Entries never move
+    (but for growing), foreign_index keeps their positions sorted by wid for lookups.
+    */
+    size_t foreign_windows_len;
+    size_t foreign_windows_cap;
+    struct X_Window_cache_entry * foreign_windows;
+    size_t foreign_index_len;
+    size_t * foreign_index;
 
     /*
     The resource_id_mask contains a single contiguous set of bits (at least 18).
@@ -174,18 +418,354 @@ struct X {
     X_id resource_id_mask;
 
     X_id allocated_ids_num;
+
+    /* ids given back by X_free_id, handed out again before new ones */
+    size_t free_ids_len;
+    size_t free_ids_cap;
+    X_id * free_ids;
+
+    /* sequence number of the last queued request */
+    uint16_t seq;
+
+    size_t out_len;
+    unsigned char out[X_OUT_BUF_SIZE];
+
+    size_t in_start;
+    size_t in_end;
+    unsigned char in[X_IN_BUF_SIZE];
+
+    /* a whole GenericEvent while it is being decoded */
+    size_t generic_cap;
+    unsigned char * generic;
+
+    /* XInputExtension major opcode, 0 until X_xi2_select_motion */
+    uint8_t xi_opcode;
+    struct X_Pointer_ring * pointer_ring;
+
+#ifdef X_HEADLESS
+    /* indexed like windows, the root is kept apart */
+    struct X_Headless_resource headless_root;
+    uint32_t * headless_screen; /* the root with the mapped windows composited on it */
+    size_t headless_cap;
+    struct X_Headless_resource * headless;
+#endif
+
+    /* events (and errors) that arrived while waiting for a reply, 32 bytes each */
+    size_t events_head;
+    size_t events_len;
+    size_t events_cap;
+    unsigned char * events;
+
+    /*
+    Keyboard table loaded at connect and refreshed on MappingNotify.
+    keysyms has keysyms_per_keycode columns for each of the 256 keycodes, so a keycode
+    indexes it directly; keycodes outside min_keycode..max_keycode are NoSymbol.
+    modifiers has the bit of every modifier (Shift, Lock, Control, Mod1..Mod5) a keycode is bound to.
+    */
+    X_Keycode min_keycode;
+    X_Keycode max_keycode;
+    uint8_t keysyms_per_keycode;
+    X_Keysym * keysyms;
+    uint8_t modifiers[256];
+};
+
+struct X_Sprite {
+    uint64_t hash;
+    X_id pixmap; /* 0 marks a free entry */
+    uint16_t width;
+    uint16_t height;
+    size_t size;
+
+    size_t lru_prev;    /* towards the most recently used */
+    size_t lru_next;
+    size_t bucket_next; /* also chains the free entries */
+};
+
+/*
+Images of one pixel format uploaded once into server-side pixmaps and drawn from there
+with CopyArea.
+Sprites are looked up by X_image_hash; when the pixmaps would take more than budget
+bytes, the least recently drawn ones are freed.
+*/
+struct X_Sprite_cache {
+    struct X * x;
+    struct X_Pixel_format * format; /* of every sprite in the cache */
+    X_id gc;
+
+    size_t budget;
+    size_t size;
+
+    size_t sprites_len;
+    size_t sprites_cap;
+    struct X_Sprite * sprites;
+    size_t free_sprite;
+
+    size_t buckets_len; /* power of two */
+    size_t * buckets;
+
+    size_t lru_first;
+    size_t lru_last;
 };
 
+/* depths and visuals are allocated zeroed, so partly filled screens are freed as well */
+void X_free_screens(struct X_Screen * screens, size_t screens_len) {
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < screens_len; i++) {
+        for (j = 0; j < screens[i].allowed_depths_len; j++) {
+            free(screens[i].allowed_depths[j].visuals);
+        }
+        free(screens[i].allowed_depths);
+    }
+    free(screens);
+}
+
 void X_destroy(struct X * x) {
+#ifdef X_HEADLESS
+    size_t i;
+#endif
+
     if (x == NULL) {
         return;
     }
 
     close(x->sock);
 
+    free(x->windows);
+    free(x->foreign_windows);
+    free(x->foreign_index);
+    free(x->free_ids);
+    free(x->events);
+    free(x->generic);
+    if (x->pointer_ring != NULL) {
+        free(x->pointer_ring->samples);
+        free(x->pointer_ring);
+    }
+    free(x->keysyms);
+    X_free_screens(x->screens, x->screens_len);
+    free(x->screen_formats);
+    free(x->pixmap_formats);
+#ifdef X_HEADLESS
+    for (i = 0; i < x->headless_cap; i++) {
+        free(x->headless[i].pixels);
+    }
+    free(x->headless);
+    free(x->headless_root.pixels);
+    free(x->headless_screen);
+#endif
     free(x);
 }
 
+int X_load_keyboard(struct X * x);
+
+/* shift and width of the contiguous bits of mask */
+void X_mask_bits(uint32_t mask, uint8_t * shift, uint8_t * bits) {
+    *shift = 0;
+    *bits = 0;
+    if (mask == 0) {
+        return;
+    }
+    while (! ((mask >> *shift) & 0x1)) {
+        (*shift)++;
+    }
+    while ((mask >> (*shift + *bits)) & 0x1) {
+        (*bits)++;
+        if (*shift + *bits == 32) {
+            break;
+        }
+    }
+}
+
+void X_fill_channel_table(uint32_t * table, uint32_t mask) {
+    uint8_t shift;
+    uint8_t bits;
+    uint32_t max;
+    uint32_t c;
+
+    X_mask_bits(mask, &shift, &bits);
+    max = bits >= 32 ? 0xffffffff : ((uint32_t)1 << bits) - 1;
+    for (c = 0; c < 256; c++) {
+        table[c] = (((c * max + 127) / 255) << shift) & mask;
+    }
+}
+
+int X_init_format(
+    struct X * x, size_t screen, uint8_t depth, struct X_Visual_type * visual,
+    struct X_Pixel_format * format
+) {
+    size_t i;
+
+    format->screen = screen;
+    format->root = x->screens[screen].root;
+    format->depth = depth;
+    format->bits_per_px = 0;
+    for (i = 0; i < x->pixmap_formats_len; i++) {
+        if (x->pixmap_formats[i].depth == depth) {
+            format->bits_per_px = x->pixmap_formats[i].bits_per_px;
+            format->scanline_pad = x->pixmap_formats[i].scanline_pad;
+            break;
+        }
+    }
+    if (format->bits_per_px == 0) {
+        fprintf(stderr, "No pixmap format for depth %u\n", depth);
+        return -1;
+    }
+    memcpy((void *)&format->visual, (void *)visual, sizeof(struct X_Visual_type));
+    format->colormap = 0;
+    if (visual->visual_id == x->screens[screen].root_visual) {
+        format->colormap = x->screens[screen].default_colormap;
+    }
+
+    if (visual->class == X_VISUAL_CLASS_TRUE_COLOR || visual->class == X_VISUAL_CLASS_DIRECT_COLOR) {
+        X_fill_channel_table(format->red, visual->red_mask);
+        X_fill_channel_table(format->green, visual->green_mask);
+        X_fill_channel_table(format->blue, visual->blue_mask);
+    } else {
+        memset((void *)format->red, 0, sizeof(format->red));
+        memset((void *)format->green, 0, sizeof(format->green));
+        memset((void *)format->blue, 0, sizeof(format->blue));
+    }
+
+    return 0;
+}
+
+int X_init_screen_formats(struct X * x) {
+    struct X_Screen * screen;
+    struct X_Depth * depth;
+    size_t i;
+    size_t j;
+    size_t k;
+
+    x->screen_formats =
+        (struct X_Pixel_format *)calloc(x->screens_len, sizeof(struct X_Pixel_format));
+    if (x->screen_formats == NULL) {
+        perror("calloc screen_formats");
+        return -1;
+    }
+
+    for (i = 0; i < x->screens_len; i++) {
+        screen = &x->screens[i];
+        for (j = 0; j < screen->allowed_depths_len; j++) {
+            depth = &screen->allowed_depths[j];
+            if (depth->depth != screen->root_depth) {
+                continue;
+            }
+            for (k = 0; k < depth->visuals_len; k++) {
+                if (depth->visuals[k].visual_id == screen->root_visual) {
+                    break;
+                }
+            }
+            if (k < depth->visuals_len) {
+                break;
+            }
+        }
+        if (j == screen->allowed_depths_len) {
+            fprintf(stderr, "root_visual of screen %lu not found\n", (unsigned long)i);
+            return -1;
+        }
+        if (X_init_format(x, i, depth->depth, &depth->visuals[k], &x->screen_formats[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef X_HEADLESS
+void X_fill_pixels(
+    uint32_t * dst, size_t dst_stride, uint16_t width, uint16_t height, uint32_t color);
+
+/* a connection to nothing: one 24-bit TrueColor screen backed by memory, no keyboard */
+struct X * make_X_headless() {
+    struct X * x;
+
+    x = (struct X *)calloc(1, sizeof(struct X));
+    if (x == NULL) {
+        perror("calloc X");
+        return NULL;
+    }
+
+    x->sock = -1;
+    x->resource_id_base = 0x00200000;
+    x->resource_id_mask = 0x001fffff;
+    x->root_wid = X_HEADLESS_ROOT;
+    x->min_keycode = 8;
+    x->max_keycode = 255;
+
+    x->headless_root.id = X_HEADLESS_ROOT;
+    x->headless_root.type = X_HEADLESS_WINDOW;
+    x->headless_root.mapped = 1;
+    x->headless_root.width = X_HEADLESS_WIDTH;
+    x->headless_root.height = X_HEADLESS_HEIGHT;
+    x->headless_root.pixels =
+        (uint32_t *)malloc((size_t)X_HEADLESS_WIDTH * X_HEADLESS_HEIGHT * sizeof(uint32_t));
+    if (x->headless_root.pixels == NULL) {
+        free(x);
+        perror("malloc headless_root.pixels");
+        return NULL;
+    }
+    X_fill_pixels(x->headless_root.pixels, X_HEADLESS_WIDTH, X_HEADLESS_WIDTH, X_HEADLESS_HEIGHT, 0);
+    x->headless_screen =
+        (uint32_t *)malloc((size_t)X_HEADLESS_WIDTH * X_HEADLESS_HEIGHT * sizeof(uint32_t));
+    if (x->headless_screen == NULL) {
+        free(x->headless_root.pixels);
+        free(x);
+        perror("malloc headless_screen");
+        return NULL;
+    }
+
+    x->pixmap_formats = (struct X_Pixmap_format *)calloc(1, sizeof(struct X_Pixmap_format));
+    x->screens = (struct X_Screen *)calloc(1, sizeof(struct X_Screen));
+    if (x->pixmap_formats == NULL || x->screens == NULL) {
+        X_destroy(x);
+        perror("calloc headless screen");
+        return NULL;
+    }
+    x->pixmap_formats_len = 1;
+    x->pixmap_formats[0].depth = 24;
+    x->pixmap_formats[0].bits_per_px = 32;
+    x->pixmap_formats[0].scanline_pad = 32;
+    x->screens_len = 1;
+    x->screens[0].root = X_HEADLESS_ROOT;
+    x->screens[0].width_px = X_HEADLESS_WIDTH;
+    x->screens[0].height_px = X_HEADLESS_HEIGHT;
+    x->screens[0].root_depth = 24;
+    x->screens[0].root_visual = 0x21;
+    x->screens[0].default_colormap = 0x20;
+    x->screens[0].white_px = 0x00ffffff;
+    x->screens[0].allowed_depths = (struct X_Depth *)calloc(1, sizeof(struct X_Depth));
+    if (x->screens[0].allowed_depths == NULL) {
+        X_destroy(x);
+        perror("calloc headless depth");
+        return NULL;
+    }
+    x->screens[0].allowed_depths_len = 1;
+    x->screens[0].allowed_depths[0].depth = 24;
+    x->screens[0].allowed_depths[0].visuals =
+        (struct X_Visual_type *)calloc(1, sizeof(struct X_Visual_type));
+    if (x->screens[0].allowed_depths[0].visuals == NULL) {
+        X_destroy(x);
+        perror("calloc headless visual");
+        return NULL;
+    }
+    x->screens[0].allowed_depths[0].visuals_len = 1;
+    x->screens[0].allowed_depths[0].visuals[0].visual_id = 0x21;
+    x->screens[0].allowed_depths[0].visuals[0].class = X_VISUAL_CLASS_TRUE_COLOR;
+    x->screens[0].allowed_depths[0].visuals[0].red_mask = 0x00ff0000;
+    x->screens[0].allowed_depths[0].visuals[0].green_mask = 0x0000ff00;
+    x->screens[0].allowed_depths[0].visuals[0].blue_mask = 0x000000ff;
+    x->screens[0].allowed_depths[0].visuals[0].bits_per_rgb_val = 8;
+    x->screens[0].allowed_depths[0].visuals[0].colormap_entries = 256;
+    if (X_init_screen_formats(x) != 0) {
+        X_destroy(x);
+        return NULL;
+    }
+
+    return x;
+}
+#endif
+
 struct X * make_X() {
     /* TODO: report error reasons; do not print anything */ 
 
@@ -219,12 +799,12 @@ struct X * make_X() {
     ssize_t sent_len = -1;
     ssize_t recv_len = -1;
 
-    struct X_Screen * root;
-    struct X_Depth * root_allowed_depth;
-    struct X_Visual_type * root_visual;
-
     struct X * x;
 
+#ifdef X_HEADLESS
+    return make_X_headless();
+#endif
+
     if (strlen(X_SOCKET_PATH) > sizeof(sock_addr.sun_path)) {
         fputs("X_SOCKET_PATH too long\n", stderr);
         return NULL;
@@ -366,6 +946,7 @@ struct X * make_X() {
     }
     recv_len = recv(sock, (void *)setup_resp, setup_resp_len, 0);
     if (recv_len != setup_resp_len) {
+        free(setup_resp);
         close(sock);
         perror("recv setup_resp");
         return NULL;
@@ -381,6 +962,7 @@ struct X * make_X() {
     setup_resp_field = setup_resp;
     recv_len = recv(sock, (void *)setup_resp, setup_resp_len, 0);
     if (recv_len != setup_resp_len) {
+        free(setup_resp);
         close(sock);
         perror("recv setup_resp");
         return NULL;
@@ -489,7 +1071,7 @@ struct X * make_X() {
         setup_resp_field += 2;
         setup_reply.roots[i].max_installed_maps = *(uint16_t *)setup_resp_field;
         setup_resp_field += 2;
-        setup_reply.roots[i].root_visual = *(uint16_t *)setup_resp_field;
+        setup_reply.roots[i].root_visual = *(uint32_t *)setup_resp_field;
         setup_resp_field += 4;
         switch (*(uint8_t *)setup_resp_field) {
         case 0:
@@ -517,13 +1099,7 @@ struct X * make_X() {
             (struct X_Depth *)calloc(
                 setup_reply.roots[i].allowed_depths_len, sizeof(struct X_Depth));
         if (setup_reply.roots[i].allowed_depths == NULL) {
-            for (j = 0; j < i; j++) {
-                for (k = 0; k < setup_reply.roots[j].allowed_depths_len; k++) {
-                    free(setup_reply.roots[j].allowed_depths[k].visuals);
-                }
-                free(setup_reply.roots[j].allowed_depths);
-            }
-            free(setup_reply.roots);
+            X_free_screens(setup_reply.roots, i);
             free(setup_reply.pixmap_formats);
             free(setup_reply.vendor);
             free(setup_resp);
@@ -543,7 +1119,12 @@ struct X * make_X() {
                     setup_reply.roots[i].allowed_depths[j].visuals_len,
                     sizeof(struct X_Visual_type));
             if (setup_reply.roots[i].allowed_depths[j].visuals == NULL) {
-                /* TODO: cleanup. I give up */
+                X_free_screens(setup_reply.roots, i + 1);
+                free(setup_reply.pixmap_formats);
+                free(setup_reply.vendor);
+                free(setup_resp);
+                close(sock);
+                perror("calloc visuals");
                 return NULL;
             }
             for (k = 0; k < setup_reply.roots[i].allowed_depths[j].visuals_len; k++) {
@@ -552,16 +1133,22 @@ struct X * make_X() {
                 switch (*(uint8_t *)setup_resp_field) {
                 case 0:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_STATIC_GRAY;
+                    break;
                 case 1:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_GRAY_SCALE;
+                    break;
                 case 2:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_STATIC_COLOR;
+                    break;
                 case 3:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_PSEUDO_COLOR;
+                    break;
                 case 4:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_TRUE_COLOR;
+                    break;
                 case 5:
                     setup_reply.roots[i].allowed_depths[j].visuals[k].class = X_VISUAL_CLASS_DIRECT_COLOR;
+                    break;
                 };
                 setup_resp_field += 1;
                 setup_reply.roots[i].allowed_depths[j].visuals[k].bits_per_rgb_val = *(uint8_t *)setup_resp_field;
@@ -581,7 +1168,10 @@ struct X * make_X() {
 
     x = (struct X *)malloc(sizeof(struct X));
     if (x == NULL) {
-        /* TODO: cleanup */
+        X_free_screens(setup_reply.roots, setup_reply.roots_len);
+        free(setup_reply.pixmap_formats);
+        free(setup_reply.vendor);
+        free(setup_resp);
         close(sock);
         perror("malloc X");
         return NULL;
@@ -591,216 +1181,3601 @@ struct X * make_X() {
     x->resource_id_base = setup_reply.resource_id_base;
     x->resource_id_mask = setup_reply.resource_id_mask;
     x->allocated_ids_num = 0;
+    x->free_ids_len = 0;
+    x->free_ids_cap = 0;
+    x->free_ids = NULL;
+    x->windows_cap = 0;
+    x->windows = NULL;
+    x->foreign_windows_len = 0;
+    x->foreign_windows_cap = 0;
+    x->foreign_windows = NULL;
+    x->foreign_index_len = 0;
+    x->foreign_index = NULL;
+    x->seq = 0;
+    x->out_len = 0;
+    x->in_start = 0;
+    x->in_end = 0;
+    x->generic_cap = 0;
+    x->generic = NULL;
+    x->xi_opcode = 0;
+    x->pointer_ring = NULL;
+    x->events_head = 0;
+    x->events_len = 0;
+    x->events_cap = 0;
+    x->events = NULL;
+    x->min_keycode = setup_reply.min_keycode;
+    x->max_keycode = setup_reply.max_keycode;
+    x->keysyms_per_keycode = 0;
+    x->keysyms = NULL;
+    memset((void *)x->modifiers, 0, sizeof(x->modifiers));
 
-    /* TODO: should not be picking the first root */
-
-    if (setup_reply.roots_len == 0) {
-        /* TODO: cleanup */
-        free(x);
-        close(sock);
-        return NULL;
-    }
-
-    root = &setup_reply.roots[0];
-    root_allowed_depth = NULL;
-    root_visual = NULL;
+    x->screens_len = setup_reply.roots_len;
+    x->screens = setup_reply.roots;
+    x->screen_formats = NULL;
+    x->pixmap_formats_len = setup_reply.pixmap_formats_len;
+    x->pixmap_formats = setup_reply.pixmap_formats;
+    x->default_screen = 0; /* X_SOCKET_PATH is display :0, its default screen is :0.0 */
 
-    x->root_wid = root->root;
+    free(setup_reply.vendor);
+    free(setup_resp);
 
-    for (i = 0; i < root->allowed_depths_len; i++) {
-        if (root->allowed_depths[i].depth == root->root_depth) {
-            root_allowed_depth = &root->allowed_depths[i];
-            break;
-        }
-    }
-    if (root_allowed_depth == NULL) {
-        /* TODO: cleanup */
-        fputs("root_allowed_depth not found\n", stderr);
+    if (x->screens_len == 0) {
+        fputs("no screens\n", stderr);
+        X_destroy(x);
         return NULL;
     }
-    for (i = 0; i < root_allowed_depth->visuals_len; i++) {
-        if (root_allowed_depth->visuals[i].visual_id == root->root_visual) {
-            root_visual = &root_allowed_depth->visuals[i];
-            break;
-        }
-    }
-    if (root_visual == NULL) {
-        /* TODO: cleanup */
-        fputs("root_visual not found\n", stderr);
+    if (X_init_screen_formats(x) != 0) {
+        X_destroy(x);
         return NULL;
     }
-    memcpy((void *)&x->root_visual, (void *)root_visual, sizeof(struct X_Visual_type));
+    x->root_wid = x->screens[x->default_screen].root;
 
-    for (i = 0; i < setup_reply.roots_len; i++) {
-        for (j = 0; j < setup_reply.roots[i].allowed_depths_len; j++) {
-            free(setup_reply.roots[i].allowed_depths[j].visuals);
-        }
-        free(setup_reply.roots[i].allowed_depths);
+    if (X_load_keyboard(x) != 0) {
+        X_destroy(x);
+        return NULL;
     }
-    free(setup_reply.roots);
-    free(setup_reply.pixmap_formats);
-    free(setup_reply.vendor);
-    free(setup_resp);
 
     return x;
 }
 
-X_id X_alloc_id(struct X * x) {
-    X_id id;
+uint32_t X_id_mask_shift(struct X * x) {
     uint32_t mask_shift = 0;
 
     while (! ((x->resource_id_mask >> mask_shift) & 0x1)) {
         mask_shift++;
     }
-    id = x->resource_id_base | (x->allocated_ids_num << mask_shift);
+
+    return mask_shift;
+}
+
+X_id X_alloc_id(struct X * x) {
+    X_id id;
+
+    if (x->free_ids_len > 0) {
+        x->free_ids_len--;
+        return x->free_ids[x->free_ids_len];
+    }
+
+    id = x->resource_id_base | (x->allocated_ids_num << X_id_mask_shift(x));
     x->allocated_ids_num++;
 
     return id;
 }
 
+/* allocates ids_len ids at once, for creating many resources in one batch */
+void X_alloc_ids(struct X * x, size_t ids_len, X_id * ids) {
+    uint32_t mask_shift;
+    size_t i;
+
+    for (i = 0; i < ids_len && x->free_ids_len > 0; i++) {
+        x->free_ids_len--;
+        ids[i] = x->free_ids[x->free_ids_len];
+    }
+
+    mask_shift = X_id_mask_shift(x);
+    for (; i < ids_len; i++) {
+        ids[i] = x->resource_id_base | (x->allocated_ids_num << mask_shift);
+        x->allocated_ids_num++;
+    }
+}
+
+/*
+The resource named by id must already be freed (or its free request queued),
+requests are processed in order so the id can be reused right after.
+*/
 void X_free_id(struct X * x, X_id id) {
-    (void) id;
-    /* TODO */
+    size_t new_cap;
+    X_id * free_ids;
+
+    if (x->free_ids_len == x->free_ids_cap) {
+        new_cap = x->free_ids_cap == 0 ? 64 : x->free_ids_cap * 2;
+        free_ids = (X_id *)realloc((void *)x->free_ids, new_cap * sizeof(X_id));
+        if (free_ids == NULL) {
+            /* the id is lost, which only matters once the id space runs out */
+            perror("realloc free_ids");
+            return;
+        }
+        x->free_ids = free_ids;
+        x->free_ids_cap = new_cap;
+    }
+
+    x->free_ids[x->free_ids_len] = id;
+    x->free_ids_len++;
+}
+
+/*
+For 8-bit components. The tables are only filled for TrueColor and DirectColor, for
+the other classes every colour comes out as pixel 0 (X_find_format does not return them).
+*/
+uint32_t X_format_rgb(struct X_Pixel_format * format, uint8_t r, uint8_t g, uint8_t b) {
+    return format->red[r] | format->green[g] | format->blue[b];
 }
 
 uint32_t X_rgb(struct X * x, uint32_t r, uint32_t g, uint32_t b) {
-    uint32_t res = 0;
-    size_t shift = 0;
+    struct X_Pixel_format * format = &x->screen_formats[x->default_screen];
 
-    if (x->root_visual.class != X_VISUAL_CLASS_DIRECT_COLOR) {
+    if (format->visual.class != X_VISUAL_CLASS_DIRECT_COLOR
+        && format->visual.class != X_VISUAL_CLASS_TRUE_COLOR) {
         /* TODO: this is so wrong */
         fputs("Unsupported root_visual.class. TODO\n", stderr);
         exit(1);
     }
 
-    while (! ((x->root_visual.red_mask >> shift) & 0x1)) {
-        shift++;
-    }
-    res |= (r << shift) & x->root_visual.red_mask;
-    shift = 0;
+    return X_format_rgb(format, r & 0xff, g & 0xff, b & 0xff);
+}
+
+int X_read(struct X * x, unsigned char * buf, size_t len) {
+    ssize_t recv_len;
+    size_t chunk_len;
 
-    while (! ((x->root_visual.green_mask >> shift) & 0x1)) {
-        shift++;
+#ifdef X_HEADLESS
+    if (x->in_start + len > x->in_end) {
+        /* nothing ever arrives: replies are not supported and events are stashed directly */
+        fputs("no server to read from in a headless build\n", stderr);
+        return -1;
     }
-    res |= (g << shift) & x->root_visual.green_mask;
-    shift = 0;
+#endif
 
-    while (! ((x->root_visual.blue_mask >> shift) & 0x1)) {
-        shift++;
+    while (len > 0) {
+        if (x->in_start == x->in_end) {
+            recv_len = recv(x->sock, (void *)x->in, X_IN_BUF_SIZE, 0);
+            if (recv_len <= 0) {
+                perror("recv");
+                return -1;
+            }
+            x->in_start = 0;
+            x->in_end = recv_len;
+        }
+
+        chunk_len = x->in_end - x->in_start;
+        if (chunk_len > len) {
+            chunk_len = len;
+        }
+        memcpy((void *)buf, (void *)(x->in + x->in_start), chunk_len);
+        x->in_start += chunk_len;
+        buf += chunk_len;
+        len -= chunk_len;
     }
-    res |= (b << shift) & x->root_visual.blue_mask;
 
-    return res;
+    return 0;
 }
 
-X_id X_create_window(struct X * x) {
-    X_id wid;
-    X_id parent_wid;
-    enum X_Window_Class class;
-    uint8_t depth;
-    uint16_t req_len;
-    X_id visual;
-    int16_t pos_x;
-    int16_t pos_y;
-    uint16_t width;
-    uint16_t height;
-    uint16_t border_width;
-    uint32_t value_mask;
-    uint32_t values[15];
-
-    size_t values_len;
+/* tops up the input buffer with whatever the server already sent, without blocking */
+int X_read_available(struct X * x) {
+    ssize_t recv_len;
 
-    unsigned char req[(8 + 15) * 4];
-    unsigned char * req_field;
+#ifdef X_HEADLESS
+    return 0;
+#endif
 
-    unsigned char err_resp[32];
-    uint8_t err_code;
+    memmove((void *)x->in, (void *)(x->in + x->in_start), x->in_end - x->in_start);
+    x->in_end -= x->in_start;
+    x->in_start = 0;
 
-    ssize_t sent_len = -1;
-    ssize_t recv_len = -1;
+    if (x->in_end == X_IN_BUF_SIZE) {
+        return 0;
+    }
+    recv_len = recv(x->sock, (void *)(x->in + x->in_end), X_IN_BUF_SIZE - x->in_end, MSG_DONTWAIT);
+    if (recv_len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (recv_len == 0) {
+        fputs("connection closed\n", stderr);
+        return -1;
+    }
+    x->in_end += recv_len;
+
+    return 0;
+}
+
+#ifdef X_HEADLESS
+int X_headless_execute(struct X * x, unsigned char * reqs, size_t reqs_len);
+#endif
+
+int X_flush(struct X * x) {
+#ifdef X_HEADLESS
+    int res;
+
+    res = X_headless_execute(x, x->out, x->out_len);
+    x->out_len = 0;
+
+    return res;
+#else
+    ssize_t sent_len;
+    size_t offset = 0;
+
+    while (offset < x->out_len) {
+        sent_len = send(x->sock, (void *)(x->out + offset), x->out_len - offset, 0);
+        if (sent_len <= 0) {
+            perror("send");
+            x->out_len = 0;
+            return -1;
+        }
+        offset += sent_len;
+    }
+    x->out_len = 0;
+
+    return 0;
+#endif
+}
+
+/* returns room for a request of len bytes at the end of the output buffer, flushing it if full */
+unsigned char * X_out_reserve(struct X * x, size_t len) {
+    unsigned char * req;
+
+    if (len > X_OUT_BUF_SIZE) {
+        fputs("request does not fit X_OUT_BUF_SIZE\n", stderr);
+        return NULL;
+    }
+    if (x->out_len + len > X_OUT_BUF_SIZE && X_flush(x) != 0) {
+        return NULL;
+    }
+
+    req = x->out + x->out_len;
+    x->out_len += len;
+    x->seq++;
+
+    return req;
+}
+
+/* position of wid in foreign_index, or where it would be inserted */
+size_t X_window_cache_foreign_pos(struct X * x, X_Window wid) {
+    size_t lo = 0;
+    size_t hi = x->foreign_index_len;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (x->foreign_windows[x->foreign_index[mid]].attrs.wid < wid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+struct X_Window_cache_entry * X_window_cache_get(struct X * x, X_Window wid) {
+    size_t slot;
+    size_t pos;
+
+    if (wid == 0) {
+        return NULL;
+    }
+    if ((wid & ~x->resource_id_mask) != x->resource_id_base) {
+        pos = X_window_cache_foreign_pos(x, wid);
+        if (pos == x->foreign_index_len
+            || x->foreign_windows[x->foreign_index[pos]].attrs.wid != wid) {
+            return NULL;
+        }
+        return &x->foreign_windows[x->foreign_index[pos]];
+    }
+    slot = (wid & x->resource_id_mask) >> X_id_mask_shift(x);
+    if (slot >= x->windows_cap || x->windows[slot].attrs.wid != wid) {
+        return NULL;
+    }
+
+    return &x->windows[slot];
+}
+
+void X_window_cache_unlink(struct X * x, struct X_Window_cache_entry * win) {
+    struct X_Window_cache_entry * parent;
+    struct X_Window_cache_entry * sibling;
+
+    parent = X_window_cache_get(x, win->attrs.parent);
+
+    sibling = X_window_cache_get(x, win->prev_sibling);
+    if (sibling != NULL) {
+        sibling->next_sibling = win->next_sibling;
+    } else if (parent != NULL) {
+        parent->first_child = win->next_sibling;
+    }
+
+    sibling = X_window_cache_get(x, win->next_sibling);
+    if (sibling != NULL) {
+        sibling->prev_sibling = win->prev_sibling;
+    } else if (parent != NULL) {
+        parent->last_child = win->prev_sibling;
+    }
+
+    win->prev_sibling = 0;
+    win->next_sibling = 0;
+}
+
+/* stacks win directly above the sibling `below`; 0 puts it at the bottom */
+void X_window_cache_link(struct X * x, struct X_Window_cache_entry * win, X_Window below) {
+    struct X_Window_cache_entry * parent;
+    struct X_Window_cache_entry * prev;
+    struct X_Window_cache_entry * next;
+
+    parent = X_window_cache_get(x, win->attrs.parent);
+    if (parent == NULL) {
+        /* stacking among children of windows we do not own is not tracked */
+        return;
+    }
+
+    prev = X_window_cache_get(x, below);
+    if (prev != NULL && prev->attrs.parent != win->attrs.parent) {
+        prev = NULL;
+    }
+    if (prev != NULL) {
+        next = X_window_cache_get(x, prev->next_sibling);
+    } else {
+        next = X_window_cache_get(x, parent->first_child);
+    }
+
+    if (prev != NULL) {
+        win->prev_sibling = prev->attrs.wid;
+        prev->next_sibling = win->attrs.wid;
+    } else {
+        win->prev_sibling = 0;
+        parent->first_child = win->attrs.wid;
+    }
+    if (next != NULL) {
+        win->next_sibling = next->attrs.wid;
+        next->prev_sibling = win->attrs.wid;
+    } else {
+        win->next_sibling = 0;
+        parent->last_child = win->attrs.wid;
+    }
+}
+
+/* a zeroed entry for wid, which must not be cached yet */
+struct X_Window_cache_entry * X_window_cache_alloc(struct X * x, X_Window wid) {
+    size_t slot;
+    size_t new_cap;
+    size_t pos;
+    struct X_Window_cache_entry * windows;
+    size_t * index;
+
+    if ((wid & ~x->resource_id_mask) != x->resource_id_base) {
+        /* reuse a slot of a window that is gone, only watching is rare enough to scan */
+        for (slot = 0; slot < x->foreign_windows_len; slot++) {
+            if (x->foreign_windows[slot].attrs.wid == 0) {
+                break;
+            }
+        }
+        if (slot == x->foreign_windows_cap) {
+            new_cap = x->foreign_windows_cap == 0 ? 16 : x->foreign_windows_cap * 2;
+            windows = (struct X_Window_cache_entry *)realloc(
+                (void *)x->foreign_windows, new_cap * sizeof(struct X_Window_cache_entry));
+            if (windows == NULL) {
+                perror("realloc foreign_windows");
+                return NULL;
+            }
+            x->foreign_windows = windows;
+            index = (size_t *)realloc((void *)x->foreign_index, new_cap * sizeof(size_t));
+            if (index == NULL) {
+                perror("realloc foreign_index");
+                return NULL;
+            }
+            x->foreign_index = index;
+            x->foreign_windows_cap = new_cap;
+        }
+        if (slot == x->foreign_windows_len) {
+            x->foreign_windows_len++;
+        }
+
+        pos = X_window_cache_foreign_pos(x, wid);
+        memmove(
+            (void *)(x->foreign_index + pos + 1), (void *)(x->foreign_index + pos),
+            (x->foreign_index_len - pos) * sizeof(size_t));
+        x->foreign_index[pos] = slot;
+        x->foreign_index_len++;
+
+        memset((void *)&x->foreign_windows[slot], 0, sizeof(struct X_Window_cache_entry));
+        x->foreign_windows[slot].attrs.wid = wid;
+
+        return &x->foreign_windows[slot];
+    }
+
+    slot = (wid & x->resource_id_mask) >> X_id_mask_shift(x);
+    if (slot >= x->windows_cap) {
+        new_cap = x->windows_cap == 0 ? 16 : x->windows_cap * 2;
+        while (new_cap <= slot) {
+            new_cap *= 2;
+        }
+        windows = (struct X_Window_cache_entry *)realloc(
+            (void *)x->windows, new_cap * sizeof(struct X_Window_cache_entry));
+        if (windows == NULL) {
+            perror("realloc windows");
+            return NULL;
+        }
+        memset(
+            (void *)(windows + x->windows_cap), 0,
+            (new_cap - x->windows_cap) * sizeof(struct X_Window_cache_entry));
+        x->windows = windows;
+        x->windows_cap = new_cap;
+    }
+
+    memset((void *)&x->windows[slot], 0, sizeof(struct X_Window_cache_entry));
+    x->windows[slot].attrs.wid = wid;
+
+    return &x->windows[slot];
+}
+
+/* gives back the entry of X_window_cache_alloc, win must be unlinked */
+void X_window_cache_free(struct X * x, struct X_Window_cache_entry * win) {
+    size_t pos;
+
+    if (win >= x->foreign_windows && win < x->foreign_windows + x->foreign_windows_len) {
+        pos = X_window_cache_foreign_pos(x, win->attrs.wid);
+        memmove(
+            (void *)(x->foreign_index + pos), (void *)(x->foreign_index + pos + 1),
+            (x->foreign_index_len - pos - 1) * sizeof(size_t));
+        x->foreign_index_len--;
+    }
+
+    memset((void *)win, 0, sizeof(struct X_Window_cache_entry));
+}
+
+int X_window_cache_add(
+    struct X * x, X_Window wid, X_Window parent,
+    int16_t pos_x, int16_t pos_y, uint16_t width, uint16_t height, uint16_t border_width,
+    X_Set_of_Event event_mask
+) {
+    struct X_Window_cache_entry * win;
+    struct X_Window_cache_entry * parent_win;
+
+    win = X_window_cache_alloc(x, wid);
+    if (win == NULL) {
+        return -1;
+    }
+    win->attrs.parent = parent;
+    win->attrs.pos_x = pos_x;
+    win->attrs.pos_y = pos_y;
+    win->attrs.width = width;
+    win->attrs.height = height;
+    win->attrs.border_width = border_width;
+    win->attrs.map_state = X_MAP_STATE_UNMAPPED;
+    win->attrs.event_mask = event_mask;
+
+    /* a new window goes on top of its siblings */
+    parent_win = X_window_cache_get(x, parent);
+    X_window_cache_link(x, win, parent_win != NULL ? parent_win->last_child : 0);
+
+    return 0;
+}
+
+void X_window_cache_remove(struct X * x, X_Window wid) {
+    struct X_Window_cache_entry * win;
+
+    win = X_window_cache_get(x, wid);
+    if (win == NULL) {
+        return;
+    }
+
+    /* the server destroys the whole subtree */
+    while (win->first_child != 0) {
+        X_window_cache_remove(x, win->first_child);
+    }
+
+    X_window_cache_unlink(x, win);
+    X_window_cache_free(x, win);
+}
+
+/*
+Drops win alone, its children stay cached (their own StructureNotify still arrives)
+but, like children of any window we do not cache, without a stacking order.
+*/
+void X_window_cache_forget(struct X * x, struct X_Window_cache_entry * win) {
+    struct X_Window_cache_entry * child;
+    struct X_Window_cache_entry * next;
+
+    for (child = X_window_cache_get(x, win->first_child); child != NULL; child = next) {
+        next = X_window_cache_get(x, child->next_sibling);
+        child->prev_sibling = 0;
+        child->next_sibling = 0;
+    }
+
+    X_window_cache_unlink(x, win);
+    X_window_cache_free(x, win);
+}
+
+/*
+A CreateWindow failed: the window it cached does not exist. Its id goes back to the free
+list unless the server refused the id itself (BadIDChoice).
+*/
+void X_window_cache_create_failed(struct X * x, unsigned char * error) {
+    struct X_Window_cache_entry * win;
+    X_Window wid;
+    size_t slot;
+
+    /* the error names the bad value, not the window, so the window is found by sequence */
+    for (slot = 0; slot < x->windows_cap; slot++) {
+        win = &x->windows[slot];
+        if (win->attrs.wid != 0 && win->create_pending
+            && win->create_seq == *(uint16_t *)(error + 2)) {
+            break;
+        }
+    }
+    if (slot == x->windows_cap) {
+        return;
+    }
+
+    wid = win->attrs.wid;
+    X_window_cache_remove(x, wid);
+    if (error[1] != 14) { /* IDChoice */
+        X_free_id(x, wid);
+    }
+}
+
+void X_window_cache_update(struct X * x, unsigned char * event) {
+    struct X_Window_cache_entry * win;
+    struct X_Window_cache_entry * parent;
+    X_Window above;
+
+    if (event[0] == 0) { /* Error */
+        if (*(uint8_t *)(event + 10) == 1) { /* CreateWindow */
+            X_window_cache_create_failed(x, event);
+        }
+        return;
+    }
+
+    /* any of these means the server has made the window */
+    if ((event[0] & 0x7f) >= 17 && (event[0] & 0x7f) <= 22) {
+        win = X_window_cache_get(x, *(uint32_t *)(event + 8));
+        if (win != NULL) {
+            win->create_pending = 0;
+        }
+    }
+
+    /* the top bit only says whether the event came from SendEvent */
+    switch (event[0] & 0x7f) {
+    case 17: /* DestroyNotify */
+        X_window_cache_remove(x, *(uint32_t *)(event + 8));
+        break;
+    case 18: /* UnmapNotify */
+        win = X_window_cache_get(x, *(uint32_t *)(event + 8));
+        if (win != NULL) {
+            win->mapped = 0;
+        }
+        break;
+    case 19: /* MapNotify */
+        win = X_window_cache_get(x, *(uint32_t *)(event + 8));
+        if (win != NULL) {
+            win->mapped = 1;
+            win->attrs.override_redirect = *(uint8_t *)(event + 12);
+        }
+        break;
+    case 21: /* ReparentNotify */
+        win = X_window_cache_get(x, *(uint32_t *)(event + 8));
+        if (win == NULL) {
+            break;
+        }
+        X_window_cache_unlink(x, win);
+        win->attrs.parent = *(uint32_t *)(event + 12);
+        win->attrs.pos_x = *(int16_t *)(event + 16);
+        win->attrs.pos_y = *(int16_t *)(event + 18);
+        win->attrs.override_redirect = *(uint8_t *)(event + 20);
+        parent = X_window_cache_get(x, win->attrs.parent);
+        X_window_cache_link(x, win, parent != NULL ? parent->last_child : 0);
+        break;
+    case 22: /* ConfigureNotify */
+        win = X_window_cache_get(x, *(uint32_t *)(event + 8));
+        if (win == NULL) {
+            break;
+        }
+        above = *(uint32_t *)(event + 12);
+        win->attrs.pos_x = *(int16_t *)(event + 16);
+        win->attrs.pos_y = *(int16_t *)(event + 18);
+        win->attrs.width = *(uint16_t *)(event + 20);
+        win->attrs.height = *(uint16_t *)(event + 22);
+        win->attrs.border_width = *(uint16_t *)(event + 24);
+        win->attrs.override_redirect = *(uint8_t *)(event + 26);
+        /* a sibling we do not own says nothing about the order among ours */
+        if (above == 0 || X_window_cache_get(x, above) != NULL) {
+            X_window_cache_unlink(x, win);
+            X_window_cache_link(x, win, above);
+        }
+        break;
+    }
+}
+
+enum X_Map_state X_window_cache_map_state(struct X * x, struct X_Window_cache_entry * win) {
+    if (! win->mapped) {
+        return X_MAP_STATE_UNMAPPED;
+    }
+    for (win = X_window_cache_get(x, win->attrs.parent); win != NULL;
+         win = X_window_cache_get(x, win->attrs.parent)) {
+        if (! win->mapped) {
+            return X_MAP_STATE_UNVIEWABLE;
+        }
+    }
+    /* the topmost cached ancestor is a child of a window we do not own, assume it is viewable */
+    return X_MAP_STATE_VIEWABLE;
+}
+
+/* the root of the screen win is on, found through its topmost cached ancestor */
+X_Window X_window_cache_root(struct X * x, struct X_Window_cache_entry * win) {
+    struct X_Window_cache_entry * parent;
+    size_t i;
+
+    for (parent = win; parent != NULL; parent = X_window_cache_get(x, win->attrs.parent)) {
+        win = parent;
+    }
+    for (i = 0; i < x->screens_len; i++) {
+        if (x->screens[i].root == win->attrs.parent) {
+            return x->screens[i].root;
+        }
+    }
+
+    /* a child of a window we do not own, assume the default screen */
+    return x->root_wid;
+}
+
+/*
+The getters below are answered from the window cache without a round trip.
+They return -1 for windows that are not cached; ask the server for those.
+*/
+
+int X_get_geometry(
+    struct X * x, X_Window wid,
+    int16_t * pos_x, int16_t * pos_y, uint16_t * width, uint16_t * height, uint16_t * border_width
+) {
+    struct X_Window_cache_entry * win;
+
+    win = X_window_cache_get(x, wid);
+    if (win == NULL) {
+        return -1;
+    }
+
+    *pos_x = win->attrs.pos_x;
+    *pos_y = win->attrs.pos_y;
+    *width = win->attrs.width;
+    *height = win->attrs.height;
+    *border_width = win->attrs.border_width;
+
+    return 0;
+}
+
+int X_get_window_attributes(struct X * x, X_Window wid, struct X_Window_attrs * attrs) {
+    struct X_Window_cache_entry * win;
+
+    win = X_window_cache_get(x, wid);
+    if (win == NULL) {
+        return -1;
+    }
+
+    memcpy((void *)attrs, (void *)&win->attrs, sizeof(struct X_Window_attrs));
+    attrs->map_state = X_window_cache_map_state(x, win);
+
+    return 0;
+}
+
+/* children are returned bottom-to-top, the caller frees them */
+int X_query_tree(
+    struct X * x, X_Window wid,
+    X_Window * root, X_Window * parent, X_Window ** children, size_t * children_len
+) {
+    struct X_Window_cache_entry * win;
+    struct X_Window_cache_entry * child;
+    size_t i;
+
+    win = X_window_cache_get(x, wid);
+    if (win == NULL) {
+        return -1;
+    }
+
+    *root = X_window_cache_root(x, win);
+    *parent = win->attrs.parent;
+
+    *children_len = 0;
+    for (child = X_window_cache_get(x, win->first_child); child != NULL;
+         child = X_window_cache_get(x, child->next_sibling)) {
+        (*children_len)++;
+    }
+
+    *children = NULL;
+    if (*children_len == 0) {
+        return 0;
+    }
+    *children = (X_Window *)malloc(*children_len * sizeof(X_Window));
+    if (*children == NULL) {
+        perror("malloc children");
+        return -1;
+    }
+    i = 0;
+    for (child = X_window_cache_get(x, win->first_child); child != NULL;
+         child = X_window_cache_get(x, child->next_sibling)) {
+        (*children)[i] = child->attrs.wid;
+        i++;
+    }
+
+    return 0;
+}
+
+struct X_Pointer_ring * X_pointer_ring_create(size_t cap) {
+    struct X_Pointer_ring * ring;
+    size_t pow2_cap = 1;
+
+    while (pow2_cap < cap) {
+        pow2_cap *= 2;
+    }
+
+    ring = (struct X_Pointer_ring *)malloc(sizeof(struct X_Pointer_ring));
+    if (ring == NULL) {
+        perror("malloc X_Pointer_ring");
+        return NULL;
+    }
+    ring->samples = (struct X_Pointer_sample *)malloc(pow2_cap * sizeof(struct X_Pointer_sample));
+    if (ring->samples == NULL) {
+        free(ring);
+        perror("malloc samples");
+        return NULL;
+    }
+    ring->cap = pow2_cap;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->overflows = 0;
+    ring->overflowing = 0;
+
+    return ring;
+}
+
+/* producer side, returns a slot to fill or NULL (and counts the drop) if the ring is full */
+struct X_Pointer_sample * X_pointer_ring_slot(struct X_Pointer_ring * ring) {
+    size_t tail;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail == ring->cap) {
+        if (! ring->overflowing) {
+            ring->overflowing = 1;
+            __atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    ring->overflowing = 0;
+
+    return &ring->samples[ring->head & (ring->cap - 1)];
+}
+
+/* producer side, publishes the slot returned by X_pointer_ring_slot */
+void X_pointer_ring_push(struct X_Pointer_ring * ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer side, safe to call from another thread than the one reading the connection */
+size_t X_pointer_ring_drain(
+    struct X_Pointer_ring * ring, struct X_Pointer_sample * samples, size_t samples_len
+) {
+    size_t head;
+    size_t tail;
+    size_t i;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    for (i = 0; i < samples_len && tail != head; i++) {
+        samples[i] = ring->samples[tail & (ring->cap - 1)];
+        tail++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    return i;
+}
+
+void X_pointer_ring_stats(struct X_Pointer_ring * ring, size_t * dropped, size_t * overflows) {
+    *dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    *overflows = __atomic_load_n(&ring->overflows, __ATOMIC_RELAXED);
+}
+
+double X_fp3232(unsigned char * field) {
+    return *(int32_t *)field + *(uint32_t *)(field + 4) / 4294967296.0;
+}
+
+/*
+Reads the valuator mask at mask_offset and the FP3232 values following it.
+Returns 0, or -1 if the event is too short for them.
+*/
+int X_xi2_read_valuators(
+    unsigned char * event, size_t event_len, size_t mask_offset, uint16_t mask_len,
+    struct X_Pointer_sample * sample
+) {
+    size_t values_offset;
+    uint32_t mask_word;
+    size_t i;
+
+    values_offset = mask_offset + mask_len * 4;
+    if (values_offset > event_len) {
+        return -1;
+    }
+
+    sample->valuators_mask = 0;
+    for (i = 0; i < (size_t)mask_len * 32; i++) {
+        mask_word = *(uint32_t *)(event + mask_offset + i / 32 * 4);
+        if (! ((mask_word >> (i % 32)) & 0x1)) {
+            continue;
+        }
+        if (values_offset + 8 > event_len) {
+            return -1;
+        }
+        if (i < X_XI_VALUATORS) {
+            sample->valuators[i] = X_fp3232(event + values_offset);
+            sample->valuators_mask |= 1 << i;
+        }
+        values_offset += 8;
+    }
+
+    return 0;
+}
+
+/* decodes an XI_Motion (6) or XI_RawMotion (17) GenericEvent into the pointer ring */
+void X_xi2_push_motion(struct X * x, unsigned char * event, size_t event_len) {
+    struct X_Pointer_sample * sample;
+    uint16_t evtype;
+    uint16_t buttons_len;
+    uint16_t valuators_len;
+    size_t raw_mask_offset;
+    size_t raw_mask_bits;
+    size_t i;
+
+    evtype = *(uint16_t *)(event + 8);
+    if ((evtype != 6 || event_len < 80) && (evtype != 17 || event_len < 32)) {
+        return;
+    }
+
+    sample = X_pointer_ring_slot(x->pointer_ring);
+    if (sample == NULL) {
+        return;
+    }
+
+    sample->deviceid = *(uint16_t *)(event + 10);
+    sample->time = *(uint32_t *)(event + 12);
+
+    if (evtype == 6) { /* XI_Motion */
+        sample->raw = 0;
+        sample->event = *(uint32_t *)(event + 24);
+        sample->x = *(int32_t *)(event + 40) / 65536.0;
+        sample->y = *(int32_t *)(event + 44) / 65536.0;
+        buttons_len = *(uint16_t *)(event + 48);
+        valuators_len = *(uint16_t *)(event + 50);
+        sample->sourceid = *(uint16_t *)(event + 52);
+        if (X_xi2_read_valuators(event, event_len, 80 + buttons_len * 4, valuators_len, sample) != 0) {
+            return;
+        }
+    } else { /* XI_RawMotion */
+        sample->raw = 1;
+        sample->event = 0;
+        sample->sourceid = *(uint16_t *)(event + 20);
+        valuators_len = *(uint16_t *)(event + 22);
+        if (X_xi2_read_valuators(event, event_len, 32, valuators_len, sample) != 0) {
+            return;
+        }
+        /* the accelerated values come first, the raw ones follow in the same order */
+        raw_mask_offset = 32 + valuators_len * 4;
+        raw_mask_bits = 0;
+        for (i = 0; i < (size_t)valuators_len * 32; i++) {
+            if ((*(uint32_t *)(event + 32 + i / 32 * 4) >> (i % 32)) & 0x1) {
+                raw_mask_bits++;
+            }
+        }
+        raw_mask_offset += raw_mask_bits * 8;
+        for (i = 0; i < (size_t)valuators_len * 32 && raw_mask_offset + 8 <= event_len; i++) {
+            if (! ((*(uint32_t *)(event + 32 + i / 32 * 4) >> (i % 32)) & 0x1)) {
+                continue;
+            }
+            if (i < X_XI_VALUATORS) {
+                sample->valuators[i] = X_fp3232(event + raw_mask_offset);
+            }
+            raw_mask_offset += 8;
+        }
+        sample->x = (sample->valuators_mask & 0x1) ? sample->valuators[0] : 0;
+        sample->y = (sample->valuators_mask & 0x2) ? sample->valuators[1] : 0;
+    }
+
+    X_pointer_ring_push(x->pointer_ring);
+}
+
+/*
+Applies an event just read from the connection: keeps the window cache in sync and
+reads the rest of a GenericEvent, feeding XInput2 motion into the pointer ring.
+Returns 1 if the event was consumed there, 0 if it should still be delivered
+(a GenericEvent only by its first 32 bytes), -1 on failure.
+*/
+int X_handle_event(struct X * x, unsigned char * event) {
+    size_t event_len;
+    unsigned char * generic;
+
+    if ((event[0] & 0x7f) != 35) { /* GenericEvent */
+        X_window_cache_update(x, event);
+        return 0;
+    }
+
+    event_len = 32 + *(uint32_t *)(event + 4) * 4;
+    if (event_len > x->generic_cap) {
+        generic = (unsigned char *)realloc((void *)x->generic, event_len);
+        if (generic == NULL) {
+            perror("realloc generic");
+            return -1;
+        }
+        x->generic = generic;
+        x->generic_cap = event_len;
+    }
+    memcpy((void *)x->generic, (void *)event, 32);
+    if (X_read(x, x->generic + 32, event_len - 32) != 0) {
+        return -1;
+    }
+
+    if (x->xi_opcode != 0 && event[1] == x->xi_opcode && x->pointer_ring != NULL
+        && (*(uint16_t *)(x->generic + 8) == 6 || *(uint16_t *)(x->generic + 8) == 17)) {
+        /* XI_Motion, XI_RawMotion; other XInput2 events are delivered */
+        X_xi2_push_motion(x, x->generic, event_len);
+        return 1;
+    }
+
+    return 0;
+}
+
+int X_stash_event(struct X * x, unsigned char * event) {
+    size_t new_cap;
+    unsigned char * events;
+
+    if (x->events_len == x->events_cap) {
+        new_cap = x->events_cap == 0 ? 16 : x->events_cap * 2;
+        events = (unsigned char *)realloc((void *)x->events, new_cap * 32);
+        if (events == NULL) {
+            perror("realloc events");
+            return -1;
+        }
+        x->events = events;
+        x->events_cap = new_cap;
+    }
+
+    memcpy((void *)(x->events + x->events_len * 32), (void *)event, 32);
+    x->events_len++;
+
+    return 0;
+}
+
+/* the code X_recv_reply gives back, 0 (the connection failed, already reported) is skipped */
+void X_report_error(const char * request, uint8_t error_code) {
+    if (error_code != 0) {
+        fprintf(stderr, "%s failed with X error %u\n", request, error_code);
+    }
+}
+
+/*
+Reads until the reply to request seq arrives; the caller frees it.
+Events and errors of other requests met on the way are stashed for X_next_event.
+If the request failed, NULL is returned and *error_code (unless it is NULL) is set to the
+X error code; it is 0 when the connection failed instead.
+*/
+unsigned char * X_recv_reply(struct X * x, uint16_t seq, uint8_t * error_code) {
+    unsigned char head[32];
+    unsigned char * reply;
+    size_t reply_len;
+
+    if (error_code != NULL) {
+        *error_code = 0;
+    }
+
+    for (;;) {
+        if (X_read(x, head, 32) != 0) {
+            return NULL;
+        }
+
+        switch (head[0]) {
+        case 0: /* Error */
+            if (*(uint16_t *)(head + 2) == seq) {
+                if (error_code != NULL) {
+                    *error_code = head[1];
+                }
+                return NULL;
+            }
+            X_window_cache_update(x, head);
+            if (X_stash_event(x, head) != 0) {
+                return NULL;
+            }
+            break;
+        case 1: /* Reply */
+            reply_len = 32 + *(uint32_t *)(head + 4) * 4;
+            reply = (unsigned char *)malloc(reply_len);
+            if (reply == NULL) {
+                perror("malloc reply");
+                return NULL;
+            }
+            memcpy((void *)reply, (void *)head, 32);
+            if (X_read(x, reply + 32, reply_len - 32) != 0) {
+                free(reply);
+                return NULL;
+            }
+            if (*(uint16_t *)(head + 2) == seq) {
+                return reply;
+            }
+            /* a reply nobody waits for */
+            free(reply);
+            break;
+        default:
+            switch (X_handle_event(x, head)) {
+            case 0:
+                if (X_stash_event(x, head) != 0) {
+                    return NULL;
+                }
+                break;
+            case 1:
+                break;
+            default:
+                return NULL;
+            }
+            break;
+        }
+    }
+}
+
+int X_queue_get_keyboard_mapping(struct X * x, X_Keycode first_keycode, uint8_t count) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 101; /* GetKeyboardMapping */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint8_t *)req_field = first_keycode;
+    req_field += 1;
+    *(uint8_t *)req_field = count;
+    req_field += 1;
+    req_field += 2; /* unused */
+
+    return 0;
+}
+
+int X_queue_get_modifier_mapping(struct X * x) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 4);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 119; /* GetModifierMapping */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 1;
+
+    return 0;
+}
+
+/* copies a GetKeyboardMapping reply for count keycodes starting at first_keycode into the table */
+int X_apply_keyboard_mapping(
+    struct X * x, unsigned char * reply, X_Keycode first_keycode, size_t count
+) {
+    uint8_t keysyms_per_keycode;
+    X_Keysym * keysyms;
+    size_t i;
+    size_t j;
+
+    keysyms_per_keycode = *(uint8_t *)(reply + 1);
+    if (keysyms_per_keycode == 0) {
+        return 0;
+    }
+    if (first_keycode + count > 256 || *(uint32_t *)(reply + 4) < count * keysyms_per_keycode) {
+        fputs("Malformed GetKeyboardMapping reply\n", stderr);
+        return -1;
+    }
+
+    if (keysyms_per_keycode != x->keysyms_per_keycode) {
+        /* the table is rebuilt in the new width, rows outside the reply keep their keysyms */
+        keysyms = (X_Keysym *)calloc(256 * keysyms_per_keycode, sizeof(X_Keysym));
+        if (keysyms == NULL) {
+            perror("calloc keysyms");
+            return -1;
+        }
+        for (i = 0; i < 256 && x->keysyms != NULL; i++) {
+            for (j = 0; j < keysyms_per_keycode && j < x->keysyms_per_keycode; j++) {
+                keysyms[i * keysyms_per_keycode + j] = x->keysyms[i * x->keysyms_per_keycode + j];
+            }
+        }
+        free(x->keysyms);
+        x->keysyms = keysyms;
+        x->keysyms_per_keycode = keysyms_per_keycode;
+    }
+
+    memcpy(
+        (void *)(x->keysyms + first_keycode * keysyms_per_keycode), (void *)(reply + 32),
+        count * keysyms_per_keycode * sizeof(X_Keysym));
+
+    return 0;
+}
+
+int X_apply_modifier_mapping(struct X * x, unsigned char * reply) {
+    uint8_t keycodes_per_modifier;
+    X_Keycode keycode;
+    size_t i;
+    size_t j;
+
+    keycodes_per_modifier = *(uint8_t *)(reply + 1);
+    if (*(uint32_t *)(reply + 4) * 4 < keycodes_per_modifier * 8) {
+        fputs("Malformed GetModifierMapping reply\n", stderr);
+        return -1;
+    }
+
+    memset((void *)x->modifiers, 0, sizeof(x->modifiers));
+    /* eight rows: Shift, Lock, Control, Mod1..Mod5 */
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < keycodes_per_modifier; j++) {
+            keycode = *(uint8_t *)(reply + 32 + i * keycodes_per_modifier + j);
+            if (keycode != 0) {
+                x->modifiers[keycode] |= 1 << i;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* fetches both mappings in one round trip */
+int X_load_keyboard(struct X * x) {
+    uint16_t keyboard_seq;
+    uint16_t modifier_seq;
+    size_t count;
+    unsigned char * reply;
+    uint8_t error_code;
+    int res;
+
+    count = x->max_keycode - x->min_keycode + 1;
+
+    if (X_queue_get_keyboard_mapping(x, x->min_keycode, count) != 0) {
+        return -1;
+    }
+    keyboard_seq = x->seq;
+    if (X_queue_get_modifier_mapping(x) != 0) {
+        return -1;
+    }
+    modifier_seq = x->seq;
+    if (X_flush(x) != 0) {
+        return -1;
+    }
+
+    reply = X_recv_reply(x, keyboard_seq, &error_code);
+    if (reply == NULL) {
+        X_report_error("GetKeyboardMapping", error_code);
+        return -1;
+    }
+    res = X_apply_keyboard_mapping(x, reply, x->min_keycode, count);
+    free(reply);
+    if (res != 0) {
+        return -1;
+    }
+
+    reply = X_recv_reply(x, modifier_seq, &error_code);
+    if (reply == NULL) {
+        X_report_error("GetModifierMapping", error_code);
+        return -1;
+    }
+    res = X_apply_modifier_mapping(x, reply);
+    free(reply);
+
+    return res;
+}
+
+int X_refresh_mapping(struct X * x, unsigned char * event) {
+    X_Keycode first_keycode;
+    uint8_t count;
+    unsigned char * reply;
+    uint8_t error_code;
+    int res;
+
+    switch (*(uint8_t *)(event + 4)) {
+    case 0: /* Modifier */
+        if (X_queue_get_modifier_mapping(x) != 0 || X_flush(x) != 0) {
+            return -1;
+        }
+        reply = X_recv_reply(x, x->seq, &error_code);
+        if (reply == NULL) {
+            X_report_error("GetModifierMapping", error_code);
+            return -1;
+        }
+        res = X_apply_modifier_mapping(x, reply);
+        free(reply);
+        return res;
+    case 1: /* Keyboard */
+        first_keycode = *(uint8_t *)(event + 5);
+        count = *(uint8_t *)(event + 6);
+        if (X_queue_get_keyboard_mapping(x, first_keycode, count) != 0 || X_flush(x) != 0) {
+            return -1;
+        }
+        reply = X_recv_reply(x, x->seq, &error_code);
+        if (reply == NULL) {
+            X_report_error("GetKeyboardMapping", error_code);
+            return -1;
+        }
+        res = X_apply_keyboard_mapping(x, reply, first_keycode, count);
+        free(reply);
+        return res;
+    default: /* Pointer */
+        return 0;
+    }
+}
+
+/* uppercase of a Latin-1 keysym, or the keysym itself */
+X_Keysym X_keysym_upper(X_Keysym keysym) {
+    if ((keysym >= 0x61 && keysym <= 0x7a)
+        || (keysym >= 0xe0 && keysym <= 0xfe && keysym != 0xf7)) {
+        return keysym - 0x20;
+    }
+    return keysym;
+}
+
+/*
+Translates a KeyPress or KeyRelease event with no round trip.
+Follows the core protocol rules for Shift and Lock (as Caps Lock) in group 1 only.
+*/
+int X_translate_key(struct X * x, unsigned char * event, struct X_Key * key) {
+    X_Keysym * row;
+    X_Keysym lower;
+    X_Keysym upper;
+
+    if ((event[0] & 0x7f) != 2 && (event[0] & 0x7f) != 3) {
+        return -1;
+    }
+
+    key->keycode = *(uint8_t *)(event + 1);
+    key->state = *(uint16_t *)(event + 28);
+    key->modifiers = x->modifiers[key->keycode];
+
+    if (x->keysyms_per_keycode == 0) {
+        key->keysym = 0; /* NoSymbol */
+        return 0;
+    }
+
+    row = x->keysyms + key->keycode * x->keysyms_per_keycode;
+    lower = row[0];
+    upper = x->keysyms_per_keycode > 1 ? row[1] : 0;
+    if (upper == 0) {
+        upper = X_keysym_upper(lower);
+    }
+
+    key->keysym = (key->state & 0x0001) ? upper : lower; /* Shift */
+    if (key->state & 0x0002) { /* Lock */
+        key->keysym = X_keysym_upper(key->keysym);
+    }
+
+    return 0;
+}
+
+int X_discard_reply(struct X * x, unsigned char * head) {
+    unsigned char rest[256];
+    size_t rest_len;
+    size_t chunk_len;
+
+    rest_len = *(uint32_t *)(head + 4) * 4;
+    while (rest_len > 0) {
+        chunk_len = rest_len < sizeof(rest) ? rest_len : sizeof(rest);
+        if (X_read(x, rest, chunk_len) != 0) {
+            return -1;
+        }
+        rest_len -= chunk_len;
+    }
+
+    return 0;
+}
+
+/*
+Blocks until the next event (or error) arrives and keeps the window cache and the
+keyboard table in sync with it. XInput2 motion goes to the pointer ring instead.
+*/
+int X_next_event(struct X * x, unsigned char * event) {
+    if (X_flush(x) != 0) {
+        return -1;
+    }
+
+    if (x->events_head < x->events_len) {
+        /* already went through X_handle_event when it was stashed */
+        memcpy((void *)event, (void *)(x->events + x->events_head * 32), 32);
+        x->events_head++;
+        if (x->events_head == x->events_len) {
+            x->events_head = 0;
+            x->events_len = 0;
+        }
+    } else {
+        for (;;) {
+            if (X_read(x, event, 32) != 0) {
+                return -1;
+            }
+            if (event[0] == 1) { /* a reply nobody waits for */
+                if (X_discard_reply(x, event) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            switch (X_handle_event(x, event)) {
+            case 0:
+                break;
+            case 1:
+                continue;
+            default:
+                return -1;
+            }
+            break;
+        }
+    }
+
+    if ((event[0] & 0x7f) == 34 && X_refresh_mapping(x, event) != 0) { /* MappingNotify */
+        fputs("could not refresh keyboard mapping\n", stderr);
+    }
+
+    return 0;
+}
+
+/*
+Handles everything the server has sent so far without blocking: XInput2 motion lands in
+the pointer ring, other events are stashed for X_next_event. Meant to be called in a
+loop by the thread that owns the connection, e.g. after poll() on x->sock.
+A GenericEvent or reply that has not fully arrived is left for the next call; only one
+larger than the whole input buffer is read through, waiting for its tail.
+*/
+int X_pump_events(struct X * x) {
+    unsigned char event[32];
+    unsigned char * head;
+    size_t needed;
+
+    if (X_flush(x) != 0 || X_read_available(x) != 0) {
+        return -1;
+    }
+
+    while (x->in_end - x->in_start >= 32) {
+        head = x->in + x->in_start;
+        needed = 32;
+        if (head[0] == 1 || (head[0] & 0x7f) == 35) { /* Reply, GenericEvent */
+            needed += *(uint32_t *)(head + 4) * 4;
+        }
+        if (needed > x->in_end - x->in_start && needed <= X_IN_BUF_SIZE) {
+            if (X_read_available(x) != 0) {
+                return -1;
+            }
+            if (needed > x->in_end - x->in_start) {
+                break;
+            }
+        }
+
+        if (X_read(x, event, 32) != 0) {
+            return -1;
+        }
+        if (event[0] == 1) {
+            if (X_discard_reply(x, event) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        switch (X_handle_event(x, event)) {
+        case 0:
+            if (X_stash_event(x, event) != 0) {
+                return -1;
+            }
+            break;
+        case 1:
+            break;
+        default:
+            return -1;
+        }
+        if (x->in_end - x->in_start < 32 && X_read_available(x) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int X_query_xi2(struct X * x) {
+    unsigned char name[] = "XInputExtension";
+    size_t name_len = sizeof(name) - 1; /* without terminator */
+    unsigned char * req;
+    unsigned char * req_field;
+    unsigned char * reply;
+    uint16_t req_len;
+    uint8_t error_code;
+
+    req_len = 2 + (name_len + X_NET_PAD(name_len)) / 4;
+    req = X_out_reserve(x, req_len * 4);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 98; /* QueryExtension */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = req_len;
+    req_field += 2;
+    *(uint16_t *)req_field = name_len;
+    req_field += 2;
+    req_field += 2; /* unused */
+    memcpy((void *)req_field, (void *)name, name_len);
+    req_field += name_len;
+    memset((void *)req_field, 0, X_NET_PAD(name_len));
+
+    if (X_flush(x) != 0) {
+        return -1;
+    }
+    reply = X_recv_reply(x, x->seq, &error_code);
+    if (reply == NULL) {
+        X_report_error("QueryExtension", error_code);
+        return -1;
+    }
+    if (*(uint8_t *)(reply + 8) == 0) {
+        free(reply);
+        fputs("XInputExtension not present\n", stderr);
+        return -1;
+    }
+    x->xi_opcode = *(uint8_t *)(reply + 9);
+    free(reply);
+
+    /* the server ignores XI2 requests from clients that did not announce their version */
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = x->xi_opcode;
+    req_field += 1;
+    *(uint8_t *)req_field = 47; /* XIQueryVersion */
+    req_field += 1;
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint16_t *)req_field = 2; /* major */
+    req_field += 2;
+    *(uint16_t *)req_field = 2; /* minor */
+
+    if (X_flush(x) != 0) {
+        return -1;
+    }
+    reply = X_recv_reply(x, x->seq, &error_code);
+    if (reply == NULL) {
+        X_report_error("XIQueryVersion", error_code);
+        return -1;
+    }
+    if (*(uint16_t *)(reply + 8) < 2) {
+        free(reply);
+        fputs("XInput2 not supported\n", stderr);
+        return -1;
+    }
+    free(reply);
+
+    return 0;
+}
+
+int X_queue_xi2_select_events(struct X * x, X_Window window, uint32_t mask) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 20);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = x->xi_opcode;
+    req_field += 1;
+    *(uint8_t *)req_field = 46; /* XISelectEvents */
+    req_field += 1;
+    *(uint16_t *)req_field = 5;
+    req_field += 2;
+    *(uint32_t *)req_field = window;
+    req_field += 4;
+    *(uint16_t *)req_field = 1; /* num_masks */
+    req_field += 2;
+    req_field += 2; /* pad */
+    *(uint16_t *)req_field = 1; /* XIAllMasterDevices */
+    req_field += 2;
+    *(uint16_t *)req_field = 1; /* mask_len */
+    req_field += 2;
+    *(uint32_t *)req_field = mask;
+
+    return 0;
+}
+
+/*
+Selects XI_RawMotion on the root window of every screen and, if window is not 0, XI_Motion on window.
+From then on every such event is decoded into x->pointer_ring, which holds ring_cap
+samples (rounded up to a power of two).
+*/
+int X_xi2_select_motion(struct X * x, X_Window window, size_t ring_cap) {
+    size_t i;
+
+    if (x->xi_opcode == 0 && X_query_xi2(x) != 0) {
+        return -1;
+    }
+
+    if (x->pointer_ring == NULL) {
+        x->pointer_ring = X_pointer_ring_create(ring_cap);
+        if (x->pointer_ring == NULL) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < x->screens_len; i++) {
+        if (X_queue_xi2_select_events(x, x->screens[i].root, 1 << 17) != 0) { /* XI_RawMotion */
+            return -1;
+        }
+    }
+    if (window != 0 && X_queue_xi2_select_events(x, window, 1 << 6) != 0) { /* XI_Motion */
+        return -1;
+    }
+
+    return X_flush(x);
+}
+
+void X_value_list_init(struct X_Value_list * list) {
+    list->mask = 0;
+    list->values_len = 0;
+}
+
+/* bit is a single X_WIN_ATTR_* or X_CONFIG_* flag; setting it again replaces the value */
+int X_value_list_set(struct X_Value_list * list, uint32_t bit, uint32_t value) {
+    size_t index = 0;
+    uint32_t lower;
+
+    if (bit == 0 || (bit & (bit - 1)) != 0 || bit > X_WIN_ATTR_CURSOR) {
+        fprintf(stderr, "Invalid value-mask bit: '%x'\n", bit);
+        return -1;
+    }
+
+    for (lower = list->mask & (bit - 1); lower != 0; lower &= lower - 1) {
+        index++;
+    }
+
+    if (! (list->mask & bit)) {
+        memmove(
+            (void *)(list->values + index + 1), (void *)(list->values + index),
+            (list->values_len - index) * 4);
+        list->mask |= bit;
+        list->values_len++;
+    }
+    list->values[index] = value;
+
+    return 0;
+}
+
+int X_value_list_get(struct X_Value_list * list, uint32_t bit, uint32_t * value) {
+    size_t index = 0;
+    uint32_t lower;
+
+    if (! (list->mask & bit)) {
+        return -1;
+    }
+
+    for (lower = list->mask & (bit - 1); lower != 0; lower &= lower - 1) {
+        index++;
+    }
+    *value = list->values[index];
+
+    return 0;
+}
+
+/*
+The X_queue_* functions only append a request to the output buffer; nothing is sent
+until X_flush (or X_next_event). Errors are reported asynchronously through X_next_event.
+*/
+
+/* alloc_all allocates every entry writable, only for DirectColor (and the other dynamic classes) */
+int X_queue_create_colormap(
+    struct X * x, X_Colormap mid, X_Window root, X_id visual, uint8_t alloc_all
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 16);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 78; /* CreateColormap */
+    req_field += 1;
+    *(uint8_t *)req_field = alloc_all ? 1 : 0; /* alloc: All or None */
+    req_field += 1;
+    *(uint16_t *)req_field = 4;
+    req_field += 2;
+    *(uint32_t *)req_field = mid;
+    req_field += 4;
+    *(uint32_t *)req_field = root;
+    req_field += 4;
+    *(uint32_t *)req_field = visual;
+
+    return 0;
+}
+
+int X_queue_free_colormap(struct X * x, X_Colormap mid) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 79; /* FreeColormap */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint32_t *)req_field = mid;
+
+    return 0;
+}
+
+/*
+Fills a DirectColor colormap so that each channel maps to its intensity linearly, which
+is what the format tables (X_format_rgb) assume.
+*/
+int X_queue_store_color_ramp(struct X * x, X_Colormap mid, struct X_Visual_type * visual) {
+    unsigned char * req;
+    unsigned char * req_field;
+    uint32_t masks[3];
+    uint8_t shifts[3];
+    uint8_t bits[3];
+    uint32_t items_len;
+    uint32_t item;
+    uint32_t items_per_req;
+    uint32_t first;
+    uint32_t count;
+    uint32_t pixel;
+    uint8_t flags;
+    size_t c;
+
+    masks[0] = visual->red_mask;
+    masks[1] = visual->green_mask;
+    masks[2] = visual->blue_mask;
+    items_len = 0;
+    for (c = 0; c < 3; c++) {
+        X_mask_bits(masks[c], &shifts[c], &bits[c]);
+        if (bits[c] == 0 || bits[c] > 16) {
+            fprintf(stderr, "Unsupported DirectColor mask: '%x'\n", masks[c]);
+            return -1;
+        }
+        if (((uint32_t)1 << bits[c]) > items_len) {
+            items_len = (uint32_t)1 << bits[c];
+        }
+    }
+
+    /* 12 bytes per item, split so that every request fits X_OUT_BUF_SIZE */
+    items_per_req = (X_OUT_BUF_SIZE - 8) / 12;
+    for (first = 0; first < items_len; first += count) {
+        count = items_len - first;
+        if (count > items_per_req) {
+            count = items_per_req;
+        }
+
+        req = X_out_reserve(x, 8 + count * 12);
+        if (req == NULL) {
+            return -1;
+        }
+
+        req_field = req;
+
+        *(uint8_t *)req_field = 89; /* StoreColors */
+        req_field += 1;
+        req_field += 1; /* unused */
+        *(uint16_t *)req_field = 2 + count * 3;
+        req_field += 2;
+        *(uint32_t *)req_field = mid;
+        req_field += 4;
+
+        for (item = first; item < first + count; item++) {
+            /* entry `item` of every channel that has that many */
+            pixel = 0;
+            flags = 0;
+            for (c = 0; c < 3; c++) {
+                if (item < ((uint32_t)1 << bits[c])) {
+                    pixel |= item << shifts[c];
+                    flags |= 1 << c; /* do-red, do-green, do-blue */
+                }
+            }
+            *(uint32_t *)req_field = pixel;
+            req_field += 4;
+            for (c = 0; c < 3; c++) {
+                *(uint16_t *)req_field =
+                    item < ((uint32_t)1 << bits[c]) ? item * 65535 / (((uint32_t)1 << bits[c]) - 1) : 0;
+                req_field += 2;
+            }
+            *(uint8_t *)req_field = flags;
+            req_field += 1;
+            req_field += 1; /* unused */
+        }
+    }
+
+    return 0;
+}
+
+void X_release_format(struct X * x, struct X_Pixel_format * format) {
+    if (format->colormap == x->screens[format->screen].default_colormap) {
+        return;
+    }
+    if (X_queue_free_colormap(x, format->colormap) == 0) {
+        X_free_id(x, format->colormap);
+    }
+}
+
+/*
+Finds the visual of a screen that best fits the requested depth and class. In order of
+preference: an exact match, the same class at the closest larger depth, then TrueColor for
+DirectColor or the other way round. On a tie the screen's root visual wins. Visuals other
+than the root one get a colormap of their own, give it back with X_release_format.
+Only TrueColor and DirectColor are taken: X_format_rgb has no tables for the colormapped
+and gray classes.
+*/
+int X_find_format(
+    struct X * x, size_t screen, uint8_t depth, enum X_Visual_type_Class class,
+    struct X_Pixel_format * format
+) {
+    struct X_Screen * scr;
+    struct X_Depth * best_depth = NULL;
+    struct X_Visual_type * best_visual = NULL;
+    struct X_Visual_type * visual;
+    int best_rank = 0;
+    int rank;
+    size_t i;
+    size_t j;
+
+    if (screen >= x->screens_len) {
+        fprintf(stderr, "No screen %lu\n", (unsigned long)screen);
+        return -1;
+    }
+    if (class != X_VISUAL_CLASS_TRUE_COLOR && class != X_VISUAL_CLASS_DIRECT_COLOR) {
+        fputs("Only TrueColor and DirectColor formats are supported\n", stderr);
+        return -1;
+    }
+    scr = &x->screens[screen];
+
+    for (i = 0; i < scr->allowed_depths_len; i++) {
+        for (j = 0; j < scr->allowed_depths[i].visuals_len; j++) {
+            visual = &scr->allowed_depths[i].visuals[j];
+
+            rank = 0;
+            if (scr->allowed_depths[i].depth < depth) {
+                continue;
+            } else if (visual->class == class) {
+                rank = scr->allowed_depths[i].depth == depth ? 3 : 2;
+            } else if ((visual->class == X_VISUAL_CLASS_TRUE_COLOR
+                        || visual->class == X_VISUAL_CLASS_DIRECT_COLOR)
+                       && (class == X_VISUAL_CLASS_TRUE_COLOR
+                           || class == X_VISUAL_CLASS_DIRECT_COLOR)) {
+                rank = 1;
+            }
+            if (rank == 0 || rank < best_rank) {
+                continue;
+            }
+
+            if (rank == best_rank) {
+                if (scr->allowed_depths[i].depth > best_depth->depth) {
+                    continue;
+                }
+                if (scr->allowed_depths[i].depth == best_depth->depth
+                    && visual->visual_id != scr->root_visual) {
+                    continue;
+                }
+            }
+
+            best_rank = rank;
+            best_depth = &scr->allowed_depths[i];
+            best_visual = visual;
+        }
+    }
+    if (best_visual == NULL) {
+        fprintf(stderr, "No visual of depth %u on screen %lu\n", depth, (unsigned long)screen);
+        return -1;
+    }
+
+    if (X_init_format(x, screen, best_depth->depth, best_visual, format) != 0) {
+        return -1;
+    }
+    if (format->colormap == 0) {
+        format->colormap = X_alloc_id(x);
+        /* a fresh DirectColor colormap is undefined until every entry is stored */
+        if (X_queue_create_colormap(
+                x, format->colormap, format->root, best_visual->visual_id,
+                best_visual->class == X_VISUAL_CLASS_DIRECT_COLOR) != 0) {
+            X_free_id(x, format->colormap);
+            return -1;
+        }
+        if (best_visual->class == X_VISUAL_CLASS_DIRECT_COLOR
+            && X_queue_store_color_ramp(x, format->colormap, best_visual) != 0) {
+            X_release_format(x, format);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+values NULL sets no attributes. format NULL copies depth and visual from parent. Otherwise
+the window gets format's visual, and when that is not the screen's root visual, its colormap
+and a border pixel unless values already has them (the parent's would not match).
+If the server rejects the window, the error drops its cache entry and gives its id back.
+*/
+int X_queue_create_window(
+    struct X * x, X_Window wid, X_Window parent, struct X_Rect * rect, uint16_t border_width,
+    struct X_Value_list * values, struct X_Pixel_format * format
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+    uint16_t req_len;
+    uint32_t event_mask;
+    uint32_t value;
+    struct X_Value_list own_values;
+    struct X_Window_cache_entry * win;
+
+    if (values == NULL) {
+        X_value_list_init(&own_values);
+        values = &own_values;
+    }
+    if (format != NULL && format->colormap != x->screens[format->screen].default_colormap) {
+        if (values != &own_values) {
+            memcpy((void *)&own_values, (void *)values, sizeof(struct X_Value_list));
+        }
+        if (! (own_values.mask & X_WIN_ATTR_COLORMAP)) {
+            X_value_list_set(&own_values, X_WIN_ATTR_COLORMAP, format->colormap);
+        }
+        if (! (own_values.mask & (X_WIN_ATTR_BORDER_PIXMAP | X_WIN_ATTR_BORDER_PIXEL))) {
+            X_value_list_set(&own_values, X_WIN_ATTR_BORDER_PIXEL, 0);
+        }
+        values = &own_values;
+    }
+
+    req_len = 8 + values->values_len;
+    req = X_out_reserve(x, req_len * 4);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 1; /* CreateWindow */
+    req_field += 1;
+    *(uint8_t *)req_field = format != NULL ? format->depth : 0; /* 0: copy from parent */
+    req_field += 1;
+    *(uint16_t *)req_field = req_len;
+    req_field += 2;
+    *(uint32_t *)req_field = wid;
+    req_field += 4;
+    *(uint32_t *)req_field = parent;
+    req_field += 4;
+    *(int16_t *)req_field = rect->pos_x;
+    req_field += 2;
+    *(int16_t *)req_field = rect->pos_y;
+    req_field += 2;
+    *(uint16_t *)req_field = rect->width;
+    req_field += 2;
+    *(uint16_t *)req_field = rect->height;
+    req_field += 2;
+    *(uint16_t *)req_field = border_width;
+    req_field += 2;
+    *(uint16_t *)req_field = X_WIN_CLASS_COPY_FROM_PARENT;
+    req_field += 2;
+    *(uint32_t *)req_field = format != NULL ? format->visual.visual_id : 0; /* 0: copy from parent */
+    req_field += 4;
+    *(uint32_t *)req_field = values->mask;
+    req_field += 4;
+    memcpy((void *)req_field, (void *)values->values, values->values_len * 4);
+
+    /* without StructureNotify the cache would go stale, so such windows are not cached */
+    if (X_value_list_get(values, X_WIN_ATTR_EVENT_MASK, &event_mask) == 0
+        && (event_mask & X_EVENT_StructureNotify)) {
+        if (X_window_cache_add(
+                x, wid, parent, rect->pos_x, rect->pos_y, rect->width, rect->height, border_width,
+                event_mask) != 0) {
+            fputs("could not cache window\n", stderr);
+            return 0;
+        }
+        win = X_window_cache_get(x, wid);
+        win->create_pending = 1;
+        win->create_seq = x->seq;
+        if (X_value_list_get(values, X_WIN_ATTR_DO_NOT_PROPAGATE_MASK, &value) == 0) {
+            win->attrs.do_not_propagate_mask = value;
+        }
+        if (X_value_list_get(values, X_WIN_ATTR_OVERRIDE_REDIRECT, &value) == 0) {
+            win->attrs.override_redirect = value;
+        }
+    }
+
+    return 0;
+}
+
+int X_queue_change_window_attributes(struct X * x, X_Window wid, struct X_Value_list * values) {
+    unsigned char * req;
+    unsigned char * req_field;
+    uint16_t req_len;
+    struct X_Window_cache_entry * win;
+    uint32_t value;
+
+    req_len = 3 + values->values_len;
+    req = X_out_reserve(x, req_len * 4);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 2; /* ChangeWindowAttributes */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = req_len;
+    req_field += 2;
+    *(uint32_t *)req_field = wid;
+    req_field += 4;
+    *(uint32_t *)req_field = values->mask;
+    req_field += 4;
+    memcpy((void *)req_field, (void *)values->values, values->values_len * 4);
+
+    /* no event reports these, so the cache is updated right away */
+    win = X_window_cache_get(x, wid);
+    if (win != NULL) {
+        if (X_value_list_get(values, X_WIN_ATTR_EVENT_MASK, &value) == 0) {
+            if (! (value & X_EVENT_StructureNotify)) {
+                /* nothing would keep the entry up to date anymore */
+                X_window_cache_forget(x, win);
+                return 0;
+            }
+            win->attrs.event_mask = value;
+        }
+        if (X_value_list_get(values, X_WIN_ATTR_DO_NOT_PROPAGATE_MASK, &value) == 0) {
+            win->attrs.do_not_propagate_mask = value;
+        }
+        if (X_value_list_get(values, X_WIN_ATTR_OVERRIDE_REDIRECT, &value) == 0) {
+            win->attrs.override_redirect = value;
+        }
+    }
+
+    return 0;
+}
+
+int X_queue_configure_window(struct X * x, X_Window wid, struct X_Value_list * values) {
+    unsigned char * req;
+    unsigned char * req_field;
+    uint16_t req_len;
+
+    if (values->mask & ~0x7f) {
+        fprintf(stderr, "Invalid ConfigureWindow value-mask: '%x'\n", values->mask);
+        return -1;
+    }
+
+    req_len = 3 + values->values_len;
+    req = X_out_reserve(x, req_len * 4);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 12; /* ConfigureWindow */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = req_len;
+    req_field += 2;
+    *(uint32_t *)req_field = wid;
+    req_field += 4;
+    *(uint16_t *)req_field = values->mask;
+    req_field += 2;
+    req_field += 2; /* unused */
+    memcpy((void *)req_field, (void *)values->values, values->values_len * 4);
+
+    return 0;
+}
+
+int X_queue_map_window(struct X * x, X_Window wid) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 8; /* MapWindow */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint32_t *)req_field = wid;
+
+    return 0;
+}
+
+/* the requests whose only argument is a window: GetWindowAttributes, GetGeometry, QueryTree... */
+int X_queue_window_request(struct X * x, uint8_t opcode, X_Window wid) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = opcode;
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint32_t *)req_field = wid;
+
+    return 0;
+}
+
+/*
+Starts caching a window of another client (or the root): selects StructureNotify on it,
+keeping whatever else this connection selected there, and seeds the entry from the server.
+Its cached children are linked under it bottom-to-top.
+*/
+int X_window_cache_watch(struct X * x, X_Window wid) {
+    unsigned char * reply;
+    struct X_Value_list values;
+    struct X_Window_cache_entry * win;
+    struct X_Window_cache_entry * child;
+    struct X_Window_cache_entry * next;
+    X_Set_of_Event event_mask;
+    uint16_t attrs_seq;
+    uint16_t geometry_seq;
+    uint16_t tree_seq;
+    uint16_t children_len;
+    X_Window * children;
+    X_Window parent;
+    size_t i;
+    uint8_t error_code;
+
+    if (X_window_cache_get(x, wid) != NULL) {
+        return 0;
+    }
+
+    /* only to keep what else this connection selected on the window */
+    if (X_queue_window_request(x, 3, wid) != 0 /* GetWindowAttributes */
+        || X_flush(x) != 0) {
+        return -1;
+    }
+    reply = X_recv_reply(x, x->seq, &error_code);
+    if (reply == NULL) {
+        X_report_error("GetWindowAttributes", error_code);
+        return -1;
+    }
+    event_mask = *(uint32_t *)(reply + 36) | X_EVENT_StructureNotify;
+    free(reply);
+
+    /*
+    Everything is asked again after the selection, so no change falls in between. The entry
+    exists while the replies come in: the events read on the way are newer than the replies
+    before them and older than the ones after, so each reply is applied as soon as it is read.
+    */
+    X_value_list_init(&values);
+    X_value_list_set(&values, X_WIN_ATTR_EVENT_MASK, event_mask);
+    if (X_queue_change_window_attributes(x, wid, &values) != 0
+        || X_queue_window_request(x, 3, wid) != 0) { /* GetWindowAttributes */
+        return -1;
+    }
+    attrs_seq = x->seq;
+    if (X_queue_window_request(x, 14, wid) != 0) { /* GetGeometry */
+        return -1;
+    }
+    geometry_seq = x->seq;
+    if (X_queue_window_request(x, 15, wid) != 0 /* QueryTree */
+        || X_flush(x) != 0) {
+        return -1;
+    }
+    tree_seq = x->seq;
+
+    /* the parent and geometry are filled in once their replies arrive */
+    if (X_window_cache_add(x, wid, 0, 0, 0, 0, 0, 0, event_mask) != 0) {
+        return -1;
+    }
+
+    reply = X_recv_reply(x, attrs_seq, &error_code);
+    win = X_window_cache_get(x, wid);
+    if (reply == NULL || win == NULL) {
+        X_report_error("GetWindowAttributes", error_code);
+        free(reply);
+        if (win != NULL) {
+            X_window_cache_forget(x, win);
+        }
+        return -1;
+    }
+    win->mapped = *(uint8_t *)(reply + 26) != 0; /* Unviewable and Viewable are both mapped */
+    win->attrs.override_redirect = *(uint8_t *)(reply + 27);
+    win->attrs.do_not_propagate_mask = *(uint16_t *)(reply + 40);
+    free(reply);
+
+    reply = X_recv_reply(x, geometry_seq, &error_code);
+    win = X_window_cache_get(x, wid);
+    if (reply == NULL || win == NULL) {
+        X_report_error("GetGeometry", error_code);
+        free(reply);
+        if (win != NULL) {
+            X_window_cache_forget(x, win);
+        }
+        return -1;
+    }
+    win->attrs.pos_x = *(int16_t *)(reply + 12);
+    win->attrs.pos_y = *(int16_t *)(reply + 14);
+    win->attrs.width = *(uint16_t *)(reply + 16);
+    win->attrs.height = *(uint16_t *)(reply + 18);
+    win->attrs.border_width = *(uint16_t *)(reply + 20);
+    free(reply);
+
+    reply = X_recv_reply(x, tree_seq, &error_code);
+    win = X_window_cache_get(x, wid);
+    if (reply == NULL || win == NULL) {
+        X_report_error("QueryTree", error_code);
+        free(reply);
+        if (win != NULL) {
+            X_window_cache_forget(x, win);
+        }
+        return -1;
+    }
+    parent = *(uint32_t *)(reply + 12);
+    if (parent != win->attrs.parent) {
+        X_window_cache_unlink(x, win);
+        win->attrs.parent = parent;
+        child = X_window_cache_get(x, parent);
+        X_window_cache_link(x, win, child != NULL ? child->last_child : 0);
+    }
+
+    /*
+    Events on the way may have linked some cached children already. The reply has the
+    order of all of them, so the list is rebuilt from it.
+    */
+    for (child = X_window_cache_get(x, win->first_child); child != NULL; child = next) {
+        next = X_window_cache_get(x, child->next_sibling);
+        child->prev_sibling = 0;
+        child->next_sibling = 0;
+    }
+    win->first_child = 0;
+    win->last_child = 0;
+    children_len = *(uint16_t *)(reply + 16);
+    children = (X_Window *)(reply + 32);
+    for (i = 0; i < children_len; i++) {
+        child = X_window_cache_get(x, children[i]);
+        if (child != NULL && child->attrs.parent == wid) {
+            X_window_cache_link(x, child, win->last_child);
+        }
+    }
+    free(reply);
+
+    return 0;
+}
+
+X_id X_create_window(
+    struct X * x, X_Window parent, struct X_Rect * rect, uint16_t border_width,
+    struct X_Value_list * values, struct X_Pixel_format * format
+) {
+    X_id wid;
+
+    wid = X_alloc_id(x);
+
+    if (X_queue_create_window(x, wid, parent, rect, border_width, values, format) != 0) {
+        X_free_id(x, wid);
+        return 0;
+    }
+    if (X_queue_map_window(x, wid) != 0 || X_flush(x) != 0) {
+        /* the window may exist on the server, so its id is not reused, but nobody gets it */
+        X_window_cache_remove(x, wid);
+        return 0;
+    }
+
+    return wid;
+}
+
+/*
+Creates windows_len children of parent, one per rect, all sharing the same attribute values
+and format (see X_queue_create_window).
+config, if not NULL, is applied to each of them before they are mapped. Everything goes out
+in a single flush; the new ids are stored in wids. On failure, the ids of the windows that
+were never queued are given back and set to 0 in wids.
+*/
+int X_create_windows(
+    struct X * x, X_Window parent, size_t windows_len, struct X_Rect * rects,
+    uint16_t border_width, struct X_Value_list * values, struct X_Pixel_format * format,
+    struct X_Value_list * config, X_Window * wids
+) {
+    size_t i;
+    int res = 0;
+
+    X_alloc_ids(x, windows_len, wids);
+
+    for (i = 0; i < windows_len && res == 0; i++) {
+        if (X_queue_create_window(
+                x, wids[i], parent, &rects[i], border_width, values, format) != 0) {
+            res = -1;
+            break;
+        }
+        if ((config != NULL && X_queue_configure_window(x, wids[i], config) != 0)
+            || X_queue_map_window(x, wids[i]) != 0) {
+            res = -1;
+        }
+    }
+    if (res != 0) {
+        /* wids[i] onwards never went out */
+        for (; i < windows_len; i++) {
+            X_free_id(x, wids[i]);
+            wids[i] = 0;
+        }
+        return -1;
+    }
+
+    return X_flush(x);
+}
+
+struct X_Pixel_format * X_image_format(struct X * x, struct X_Image * img) {
+    if (img->format != NULL) {
+        return img->format;
+    }
+    return &x->screen_formats[x->default_screen];
+}
+
+size_t X_image_stride(struct X_Pixel_format * format, uint16_t width) {
+    size_t bits;
+
+    bits = (size_t)width * format->bits_per_px;
+    bits = (bits + format->scanline_pad - 1) / format->scanline_pad * format->scanline_pad;
+
+    return bits / 8;
+}
+
+/* FNV-1a over the size and the pixels */
+uint64_t X_image_hash(struct X * x, struct X_Image * img) {
+    uint64_t hash = 14695981039346656037UL;
+    size_t len;
+    size_t i;
+
+    hash = (hash ^ img->width) * 1099511628211UL;
+    hash = (hash ^ img->height) * 1099511628211UL;
+
+    len = X_image_stride(X_image_format(x, img), img->width) * img->height;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ img->data[i]) * 1099511628211UL;
+    }
+
+    /* 0 means "not computed yet" */
+    return hash == 0 ? 1 : hash;
+}
+
+int X_queue_create_pixmap(
+    struct X * x, X_id pid, struct X_Pixel_format * format, uint16_t width, uint16_t height
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 16);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 53; /* CreatePixmap */
+    req_field += 1;
+    *(uint8_t *)req_field = format->depth;
+    req_field += 1;
+    *(uint16_t *)req_field = 4;
+    req_field += 2;
+    *(uint32_t *)req_field = pid;
+    req_field += 4;
+    *(uint32_t *)req_field = format->root; /* only picks the screen */
+    req_field += 4;
+    *(uint16_t *)req_field = width;
+    req_field += 2;
+    *(uint16_t *)req_field = height;
+
+    return 0;
+}
+
+int X_queue_free_pixmap(struct X * x, X_id pid) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 54; /* FreePixmap */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint32_t *)req_field = pid;
+
+    return 0;
+}
+
+/* a GC with graphics-exposures off, so copies do not generate NoExpose events */
+int X_queue_create_gc(struct X * x, X_id cid, X_id drawable) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 20);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 55; /* CreateGC */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 5;
+    req_field += 2;
+    *(uint32_t *)req_field = cid;
+    req_field += 4;
+    *(uint32_t *)req_field = drawable;
+    req_field += 4;
+    *(uint32_t *)req_field = 0x00010000; /* graphics-exposures */
+    req_field += 4;
+    *(uint32_t *)req_field = 0; /* False */
+
+    return 0;
+}
+
+int X_queue_free_gc(struct X * x, X_id gc) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 8);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 60; /* FreeGC */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 2;
+    req_field += 2;
+    *(uint32_t *)req_field = gc;
+
+    return 0;
+}
+
+/* split into strips of rows so that every request fits X_OUT_BUF_SIZE */
+int X_queue_put_image(
+    struct X * x, X_id drawable, X_id gc, struct X_Image * img, int16_t dst_x, int16_t dst_y
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+    struct X_Pixel_format * format;
+    size_t stride;
+    size_t rows_per_req;
+    size_t row;
+    size_t rows;
+    size_t data_len;
+
+    format = X_image_format(x, img);
+    stride = X_image_stride(format, img->width);
+    if (stride == 0) {
+        return 0;
+    }
+    rows_per_req = (X_OUT_BUF_SIZE - 24 - 3) / stride; /* room for the padding */
+    if (rows_per_req == 0) {
+        fputs("image row does not fit X_OUT_BUF_SIZE\n", stderr);
+        return -1;
+    }
+
+    for (row = 0; row < img->height; row += rows) {
+        rows = img->height - row;
+        if (rows > rows_per_req) {
+            rows = rows_per_req;
+        }
+
+        /* with a scanline pad under 32 bits the data may need padding to a whole word */
+        data_len = rows * stride;
+        req = X_out_reserve(x, 24 + data_len + X_NET_PAD(data_len));
+        if (req == NULL) {
+            return -1;
+        }
+
+        req_field = req;
+
+        *(uint8_t *)req_field = 72; /* PutImage */
+        req_field += 1;
+        *(uint8_t *)req_field = 2; /* ZPixmap */
+        req_field += 1;
+        *(uint16_t *)req_field = 6 + (data_len + X_NET_PAD(data_len)) / 4;
+        req_field += 2;
+        *(uint32_t *)req_field = drawable;
+        req_field += 4;
+        *(uint32_t *)req_field = gc;
+        req_field += 4;
+        *(uint16_t *)req_field = img->width;
+        req_field += 2;
+        *(uint16_t *)req_field = rows;
+        req_field += 2;
+        *(int16_t *)req_field = dst_x;
+        req_field += 2;
+        *(int16_t *)req_field = dst_y + row;
+        req_field += 2;
+        *(uint8_t *)req_field = 0; /* left-pad */
+        req_field += 1;
+        *(uint8_t *)req_field = format->depth;
+        req_field += 1;
+        req_field += 2; /* unused */
+        memcpy((void *)req_field, (void *)(img->data + row * stride), data_len);
+        req_field += data_len;
+        memset((void *)req_field, 0, X_NET_PAD(data_len));
+    }
+
+    return 0;
+}
+
+int X_queue_copy_area(
+    struct X * x, X_id src, X_id dst, X_id gc, int16_t src_x, int16_t src_y,
+    int16_t dst_x, int16_t dst_y, uint16_t width, uint16_t height
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 28);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 62; /* CopyArea */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 7;
+    req_field += 2;
+    *(uint32_t *)req_field = src;
+    req_field += 4;
+    *(uint32_t *)req_field = dst;
+    req_field += 4;
+    *(uint32_t *)req_field = gc;
+    req_field += 4;
+    *(int16_t *)req_field = src_x;
+    req_field += 2;
+    *(int16_t *)req_field = src_y;
+    req_field += 2;
+    *(int16_t *)req_field = dst_x;
+    req_field += 2;
+    *(int16_t *)req_field = dst_y;
+    req_field += 2;
+    *(uint16_t *)req_field = width;
+    req_field += 2;
+    *(uint16_t *)req_field = height;
+
+    return 0;
+}
+
+/* format NULL is the default screen's root visual; the format must outlive the cache */
+struct X_Sprite_cache * X_sprite_cache_create(
+    struct X * x, struct X_Pixel_format * format, size_t budget
+) {
+    struct X_Sprite_cache * cache;
+    X_id gc_drawable;
+
+    cache = (struct X_Sprite_cache *)malloc(sizeof(struct X_Sprite_cache));
+    if (cache == NULL) {
+        perror("malloc X_Sprite_cache");
+        return NULL;
+    }
+
+    cache->x = x;
+    cache->format = format != NULL ? format : &x->screen_formats[x->default_screen];
+    cache->budget = budget;
+    cache->size = 0;
+    cache->sprites_len = 0;
+    cache->sprites_cap = 0;
+    cache->sprites = NULL;
+    cache->free_sprite = X_SPRITE_NONE;
+    cache->lru_first = X_SPRITE_NONE;
+    cache->lru_last = X_SPRITE_NONE;
+
+    cache->buckets_len = 64;
+    cache->buckets = (size_t *)malloc(cache->buckets_len * sizeof(size_t));
+    if (cache->buckets == NULL) {
+        free(cache);
+        perror("malloc buckets");
+        return NULL;
+    }
+    memset((void *)cache->buckets, 0xff, cache->buckets_len * sizeof(size_t)); /* X_SPRITE_NONE */
+
+    /* the GC has to have the depth of the pixmaps, which the root may not */
+    gc_drawable = cache->format->root;
+    if (cache->format->depth != x->screens[cache->format->screen].root_depth) {
+        gc_drawable = X_alloc_id(x);
+        if (X_queue_create_pixmap(x, gc_drawable, cache->format, 1, 1) != 0) {
+            X_free_id(x, gc_drawable);
+            free(cache->buckets);
+            free(cache);
+            return NULL;
+        }
+    }
+
+    cache->gc = X_alloc_id(x);
+    if (X_queue_create_gc(x, cache->gc, gc_drawable) != 0) {
+        X_free_id(x, cache->gc);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    if (gc_drawable != cache->format->root && X_queue_free_pixmap(x, gc_drawable) == 0) {
+        X_free_id(x, gc_drawable);
+    }
+
+    return cache;
+}
+
+void X_sprite_cache_lru_unlink(struct X_Sprite_cache * cache, size_t i) {
+    struct X_Sprite * sprite = &cache->sprites[i];
+
+    if (sprite->lru_prev != X_SPRITE_NONE) {
+        cache->sprites[sprite->lru_prev].lru_next = sprite->lru_next;
+    } else {
+        cache->lru_first = sprite->lru_next;
+    }
+    if (sprite->lru_next != X_SPRITE_NONE) {
+        cache->sprites[sprite->lru_next].lru_prev = sprite->lru_prev;
+    } else {
+        cache->lru_last = sprite->lru_prev;
+    }
+}
+
+void X_sprite_cache_lru_push(struct X_Sprite_cache * cache, size_t i) {
+    struct X_Sprite * sprite = &cache->sprites[i];
+
+    sprite->lru_prev = X_SPRITE_NONE;
+    sprite->lru_next = cache->lru_first;
+    if (cache->lru_first != X_SPRITE_NONE) {
+        cache->sprites[cache->lru_first].lru_prev = i;
+    } else {
+        cache->lru_last = i;
+    }
+    cache->lru_first = i;
+}
+
+size_t X_sprite_cache_find(struct X_Sprite_cache * cache, struct X_Image * img) {
+    size_t i;
+    struct X_Sprite * sprite;
+
+    for (i = cache->buckets[img->hash & (cache->buckets_len - 1)]; i != X_SPRITE_NONE;
+         i = sprite->bucket_next) {
+        sprite = &cache->sprites[i];
+        if (sprite->hash == img->hash
+            && sprite->width == img->width && sprite->height == img->height) {
+            return i;
+        }
+    }
+
+    return X_SPRITE_NONE;
+}
+
+int X_sprite_cache_evict_last(struct X_Sprite_cache * cache) {
+    size_t i;
+    size_t * link;
+    struct X_Sprite * sprite;
+
+    i = cache->lru_last;
+    if (i == X_SPRITE_NONE) {
+        return -1;
+    }
+    sprite = &cache->sprites[i];
+
+    if (X_queue_free_pixmap(cache->x, sprite->pixmap) != 0) {
+        return -1;
+    }
+    X_free_id(cache->x, sprite->pixmap);
+
+    X_sprite_cache_lru_unlink(cache, i);
+    for (link = &cache->buckets[sprite->hash & (cache->buckets_len - 1)]; *link != i;
+         link = &cache->sprites[*link].bucket_next) {
+    }
+    *link = sprite->bucket_next;
+
+    cache->size -= sprite->size;
+    sprite->pixmap = 0;
+    sprite->bucket_next = cache->free_sprite;
+    cache->free_sprite = i;
+
+    return 0;
+}
+
+/* doubles the buckets once they hold more sprites than there are buckets */
+int X_sprite_cache_grow(struct X_Sprite_cache * cache) {
+    size_t new_cap;
+    size_t buckets_len;
+    size_t * buckets;
+    struct X_Sprite * sprites;
+    size_t i;
+    size_t bucket;
+
+    new_cap = cache->sprites_cap == 0 ? 64 : cache->sprites_cap * 2;
+    sprites = (struct X_Sprite *)realloc(
+        (void *)cache->sprites, new_cap * sizeof(struct X_Sprite));
+    if (sprites == NULL) {
+        perror("realloc sprites");
+        return -1;
+    }
+    cache->sprites = sprites;
+    cache->sprites_cap = new_cap;
+
+    if (new_cap <= cache->buckets_len) {
+        return 0;
+    }
+
+    buckets_len = cache->buckets_len * 2;
+    buckets = (size_t *)malloc(buckets_len * sizeof(size_t));
+    if (buckets == NULL) {
+        /* longer chains, still correct */
+        return 0;
+    }
+    memset((void *)buckets, 0xff, buckets_len * sizeof(size_t)); /* X_SPRITE_NONE */
+    for (i = 0; i < cache->sprites_len; i++) {
+        if (cache->sprites[i].pixmap == 0) {
+            continue;
+        }
+        bucket = cache->sprites[i].hash & (buckets_len - 1);
+        cache->sprites[i].bucket_next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->buckets_len = buckets_len;
+
+    return 0;
+}
+
+/*
+Returns the pixmap holding img, uploading it first if it is not cached yet; 0 on failure.
+Computes img->hash if it is 0, keep it in the image to skip hashing next time.
+Like the X_queue_* functions, nothing is sent until the next X_flush.
+*/
+X_id X_sprite_cache_get(struct X_Sprite_cache * cache, struct X_Image * img) {
+    struct X * x = cache->x;
+    struct X_Sprite * sprite;
+    size_t size;
+    size_t i;
+    size_t bucket;
+
+    /* checked first: the hash does not cover the format, equal data may hit a cached sprite */
+    if (X_image_format(x, img)->screen != cache->format->screen
+        || X_image_format(x, img)->depth != cache->format->depth) {
+        fputs("sprite format differs from the cache's\n", stderr);
+        return 0;
+    }
+
+    if (img->hash == 0) {
+        img->hash = X_image_hash(x, img);
+    }
+
+    i = X_sprite_cache_find(cache, img);
+    if (i != X_SPRITE_NONE) {
+        X_sprite_cache_lru_unlink(cache, i);
+        X_sprite_cache_lru_push(cache, i);
+        return cache->sprites[i].pixmap;
+    }
+
+    size = X_image_stride(cache->format, img->width) * img->height;
+    if (size > cache->budget) {
+        fputs("sprite larger than the cache budget\n", stderr);
+        return 0;
+    }
+    while (cache->size + size > cache->budget) {
+        if (X_sprite_cache_evict_last(cache) != 0) {
+            return 0;
+        }
+    }
+
+    if (cache->free_sprite != X_SPRITE_NONE) {
+        i = cache->free_sprite;
+        cache->free_sprite = cache->sprites[i].bucket_next;
+    } else {
+        if (cache->sprites_len == cache->sprites_cap && X_sprite_cache_grow(cache) != 0) {
+            return 0;
+        }
+        i = cache->sprites_len;
+        cache->sprites_len++;
+    }
+
+    sprite = &cache->sprites[i];
+    sprite->hash = img->hash;
+    sprite->width = img->width;
+    sprite->height = img->height;
+    sprite->size = size;
+    sprite->pixmap = X_alloc_id(x);
+
+    if (X_queue_create_pixmap(x, sprite->pixmap, cache->format, img->width, img->height) != 0
+        || X_queue_put_image(x, sprite->pixmap, cache->gc, img, 0, 0) != 0) {
+        /* the pixmap may exist on the server, so its id is not reused */
+        sprite->pixmap = 0;
+        sprite->bucket_next = cache->free_sprite;
+        cache->free_sprite = i;
+        return 0;
+    }
+
+    bucket = img->hash & (cache->buckets_len - 1);
+    sprite->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    X_sprite_cache_lru_push(cache, i);
+    cache->size += size;
+
+    return sprite->pixmap;
+}
+
+int X_sprite_cache_draw(
+    struct X_Sprite_cache * cache, struct X_Image * img, X_id drawable, int16_t dst_x, int16_t dst_y
+) {
+    X_id pixmap;
+
+    pixmap = X_sprite_cache_get(cache, img);
+    if (pixmap == 0) {
+        return -1;
+    }
+
+    return X_queue_copy_area(
+        cache->x, pixmap, drawable, cache->gc, 0, 0, dst_x, dst_y, img->width, img->height);
+}
+
+void X_sprite_cache_destroy(struct X_Sprite_cache * cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    while (cache->lru_last != X_SPRITE_NONE) {
+        if (X_sprite_cache_evict_last(cache) != 0) {
+            break;
+        }
+    }
+    if (X_queue_free_gc(cache->x, cache->gc) == 0) {
+        X_free_id(cache->x, cache->gc);
+    }
+
+    free(cache->buckets);
+    free(cache->sprites);
+    free(cache);
+}
+
+int X_queue_set_foreground(struct X * x, X_id gc, uint32_t pixel) {
+    unsigned char * req;
+    unsigned char * req_field;
+
+    req = X_out_reserve(x, 16);
+    if (req == NULL) {
+        return -1;
+    }
+
+    req_field = req;
+
+    *(uint8_t *)req_field = 56; /* ChangeGC */
+    req_field += 1;
+    req_field += 1; /* unused */
+    *(uint16_t *)req_field = 4;
+    req_field += 2;
+    *(uint32_t *)req_field = gc;
+    req_field += 4;
+    *(uint32_t *)req_field = 0x00000004; /* foreground */
+    req_field += 4;
+    *(uint32_t *)req_field = pixel;
+
+    return 0;
+}
+
+/* fills with the GC foreground, split into several requests if they do not fit X_OUT_BUF_SIZE */
+int X_queue_fill_rects(
+    struct X * x, X_id drawable, X_id gc, struct X_Rect * rects, size_t rects_len
+) {
+    unsigned char * req;
+    unsigned char * req_field;
+    size_t rects_per_req;
+    size_t batch_len;
+    size_t i;
+
+    rects_per_req = (X_OUT_BUF_SIZE - 12) / 8;
+
+    while (rects_len > 0) {
+        batch_len = rects_len < rects_per_req ? rects_len : rects_per_req;
+
+        req = X_out_reserve(x, 12 + batch_len * 8);
+        if (req == NULL) {
+            return -1;
+        }
+
+        req_field = req;
+
+        *(uint8_t *)req_field = 70; /* PolyFillRectangle */
+        req_field += 1;
+        req_field += 1; /* unused */
+        *(uint16_t *)req_field = 3 + batch_len * 2;
+        req_field += 2;
+        *(uint32_t *)req_field = drawable;
+        req_field += 4;
+        *(uint32_t *)req_field = gc;
+        req_field += 4;
+        for (i = 0; i < batch_len; i++) {
+            *(int16_t *)req_field = rects[i].pos_x;
+            req_field += 2;
+            *(int16_t *)req_field = rects[i].pos_y;
+            req_field += 2;
+            *(uint16_t *)req_field = rects[i].width;
+            req_field += 2;
+            *(uint16_t *)req_field = rects[i].height;
+            req_field += 2;
+        }
+
+        rects += batch_len;
+        rects_len -= batch_len;
+    }
+
+    return 0;
+}
+
+/*
+Software kernels for 32bpp pixels, strides are in pixels. Rows are filled and copied with
+memcpy/memmove so they run on the C library's vectorised loops.
+*/
+
+void X_fill_pixels(
+    uint32_t * dst, size_t dst_stride, uint16_t width, uint16_t height, uint32_t color
+) {
+    size_t filled;
+    size_t chunk;
+    size_t row;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    /* seed a few pixels, then keep doubling them until the first row is full */
+    for (filled = 0; filled < width && filled < 8; filled++) {
+        dst[filled] = color;
+    }
+    while (filled < width) {
+        chunk = width - filled < filled ? width - filled : filled;
+        memcpy((void *)(dst + filled), (void *)dst, chunk * sizeof(uint32_t));
+        filled += chunk;
+    }
+
+    for (row = 1; row < height; row++) {
+        memcpy((void *)(dst + row * dst_stride), (void *)dst, width * sizeof(uint32_t));
+    }
+}
+
+/* src and dst may overlap, as in a CopyArea within one drawable */
+void X_blit_pixels(
+    uint32_t * dst, size_t dst_stride, uint32_t * src, size_t src_stride,
+    uint16_t width, uint16_t height
+) {
+    size_t row;
+
+    if (width == 0) {
+        return;
+    }
+
+    if (dst > src) {
+        for (row = height; row > 0; row--) {
+            memmove(
+                (void *)(dst + (row - 1) * dst_stride), (void *)(src + (row - 1) * src_stride),
+                width * sizeof(uint32_t));
+        }
+    } else {
+        for (row = 0; row < height; row++) {
+            memmove(
+                (void *)(dst + row * dst_stride), (void *)(src + row * src_stride),
+                width * sizeof(uint32_t));
+        }
+    }
+}
+
+/*
+Clips the width x height area at (*dst_x, *dst_y) of a dst_width x dst_height drawable,
+moving *src_x and *src_y along. Returns 0 if nothing is left.
+*/
+int X_clip(
+    int32_t * dst_x, int32_t * dst_y, int32_t * src_x, int32_t * src_y,
+    int32_t * width, int32_t * height, int32_t dst_width, int32_t dst_height
+) {
+    if (*dst_x < 0) {
+        *width += *dst_x;
+        *src_x -= *dst_x;
+        *dst_x = 0;
+    }
+    if (*dst_y < 0) {
+        *height += *dst_y;
+        *src_y -= *dst_y;
+        *dst_y = 0;
+    }
+    if (*dst_x + *width > dst_width) {
+        *width = dst_width - *dst_x;
+    }
+    if (*dst_y + *height > dst_height) {
+        *height = dst_height - *dst_y;
+    }
 
-    wid = X_alloc_id(x);
-    parent_wid = x->root_wid;
-    class = X_WIN_CLASS_COPY_FROM_PARENT;
-    depth = 0;  /* copy from parent */
-    visual = 0; /* copy from parent */
-    pos_x = 10;
-    pos_y = 10;
-    width = 100;
-    height = 100;
-    border_width = 1;
-
-    value_mask = 0x02; /* background-pixel */
-    values_len = 2; /* because background-pixel is the second value */
-    values[1] = X_rgb(x, 255, 128, 64);
-
-    req_len = 8 + values_len;
+    return *width > 0 && *height > 0;
+}
 
-    req_field = req;
+#ifdef X_HEADLESS
+struct X_Headless_resource * X_headless_get(struct X * x, X_id id) {
+    size_t slot;
 
-    *(uint8_t *)req_field = 1; /* CreateWindow */
-    req_field += 1;
-    *(uint8_t *)req_field = depth;
-    req_field += 1;
-    *(uint16_t *)req_field = req_len;
-    req_field += 2;
-    *(uint32_t *)req_field = wid;
-    req_field += 4;
-    *(uint32_t *)req_field = parent_wid;
-    req_field += 4;
-    *(int16_t *)req_field = pos_x;
-    req_field += 2;
-    *(int16_t *)req_field = pos_y;
-    req_field += 2;
-    *(uint16_t *)req_field = width;
-    req_field += 2;
-    *(uint16_t *)req_field = height;
-    req_field += 2;
-    *(uint16_t *)req_field = border_width;
-    req_field += 2;
-    *(uint16_t *)req_field = class;
-    req_field += 2;
-    *(uint32_t *)req_field = visual;
-    req_field += 4;
-    *(uint32_t *)req_field = value_mask;
-    req_field += 4;
-    memcpy((void *)req_field, (void *)values, values_len * 4);
-    req_field += values_len * 4;
+    if (id == X_HEADLESS_ROOT) {
+        return &x->headless_root;
+    }
+    if (id == 0 || (id & ~x->resource_id_mask) != x->resource_id_base) {
+        return NULL;
+    }
+    slot = (id & x->resource_id_mask) >> X_id_mask_shift(x);
+    if (slot >= x->headless_cap || x->headless[slot].id != id) {
+        return NULL;
+    }
+
+    return &x->headless[slot];
+}
+
+void X_headless_unlink(struct X * x, struct X_Headless_resource * win) {
+    struct X_Headless_resource * parent;
+    struct X_Headless_resource * sibling;
+
+    parent = X_headless_get(x, win->parent);
+
+    sibling = X_headless_get(x, win->prev_sibling);
+    if (sibling != NULL) {
+        sibling->next_sibling = win->next_sibling;
+    } else if (parent != NULL) {
+        parent->first_child = win->next_sibling;
+    }
+
+    sibling = X_headless_get(x, win->next_sibling);
+    if (sibling != NULL) {
+        sibling->prev_sibling = win->prev_sibling;
+    } else if (parent != NULL) {
+        parent->last_child = win->prev_sibling;
+    }
+
+    win->prev_sibling = 0;
+    win->next_sibling = 0;
+}
+
+/* stacks win directly above the sibling `below`; 0 puts it at the bottom */
+void X_headless_link(struct X * x, struct X_Headless_resource * win, X_Window below) {
+    struct X_Headless_resource * parent;
+    struct X_Headless_resource * prev;
+    struct X_Headless_resource * next;
+
+    parent = X_headless_get(x, win->parent);
+    if (parent == NULL) {
+        return;
+    }
+
+    prev = X_headless_get(x, below);
+    if (prev != NULL && prev->parent != win->parent) {
+        prev = NULL;
+    }
+    if (prev != NULL) {
+        next = X_headless_get(x, prev->next_sibling);
+    } else {
+        next = X_headless_get(x, parent->first_child);
+    }
+
+    if (prev != NULL) {
+        win->prev_sibling = prev->id;
+        prev->next_sibling = win->id;
+    } else {
+        win->prev_sibling = 0;
+        parent->first_child = win->id;
+    }
+    if (next != NULL) {
+        win->next_sibling = next->id;
+        next->prev_sibling = win->id;
+    } else {
+        win->next_sibling = 0;
+        parent->last_child = win->id;
+    }
+}
+
+/* a freed window takes its children off the screen with it, like DestroyWindow */
+void X_headless_free(struct X * x, X_id id) {
+    struct X_Headless_resource * res;
+
+    res = X_headless_get(x, id);
+    if (res == NULL || res == &x->headless_root) {
+        return;
+    }
+    if (res->type == X_HEADLESS_WINDOW) {
+        while (res->first_child != 0) {
+            X_headless_free(x, res->first_child);
+        }
+        X_headless_unlink(x, res);
+    }
+    free(res->pixels);
+    memset((void *)res, 0, sizeof(struct X_Headless_resource));
+}
+
+struct X_Headless_resource * X_headless_add(struct X * x, X_id id, enum X_Headless_type type) {
+    size_t slot;
+    size_t new_cap;
+    struct X_Headless_resource * headless;
+    struct X_Headless_resource * res;
+
+    if ((id & ~x->resource_id_mask) != x->resource_id_base) {
+        fprintf(stderr, "Bad resource id: '%x'\n", id);
+        return NULL;
+    }
+
+    slot = (id & x->resource_id_mask) >> X_id_mask_shift(x);
+    if (slot >= x->headless_cap) {
+        new_cap = x->headless_cap == 0 ? 16 : x->headless_cap * 2;
+        while (new_cap <= slot) {
+            new_cap *= 2;
+        }
+        headless = (struct X_Headless_resource *)realloc(
+            (void *)x->headless, new_cap * sizeof(struct X_Headless_resource));
+        if (headless == NULL) {
+            perror("realloc headless");
+            return NULL;
+        }
+        memset(
+            (void *)(headless + x->headless_cap), 0,
+            (new_cap - x->headless_cap) * sizeof(struct X_Headless_resource));
+        x->headless = headless;
+        x->headless_cap = new_cap;
+    }
+
+    res = &x->headless[slot];
+    if (res->id != 0) {
+        X_headless_free(x, res->id);
+    }
+    res->id = id;
+    res->type = type;
+
+    return res;
+}
+
+/* (re)allocates the pixels of a window or pixmap, filled with color */
+int X_headless_resize(
+    struct X_Headless_resource * res, uint16_t width, uint16_t height, uint32_t color
+) {
+    uint32_t * pixels;
+
+    pixels = (uint32_t *)malloc(((size_t)width * height + 1) * sizeof(uint32_t));
+    if (pixels == NULL) {
+        perror("malloc headless pixels");
+        return -1;
+    }
+    X_fill_pixels(pixels, width, width, height, color);
+
+    free(res->pixels);
+    res->pixels = pixels;
+    res->width = width;
+    res->height = height;
+
+    return 0;
+}
 
-    sent_len = send(x->sock, (void *)req, (req_field - req), 0);
-    if (sent_len != (req_field - req)) {
-        perror("send");
+/* the value of bit in a LISTofVALUE with the given mask */
+int X_headless_value(unsigned char * values, uint32_t mask, uint32_t bit, uint32_t * value) {
+    size_t index = 0;
+    uint32_t lower;
+
+    if (! (mask & bit)) {
+        return -1;
+    }
+    for (lower = mask & (bit - 1); lower != 0; lower &= lower - 1) {
+        index++;
+    }
+    *value = *(uint32_t *)(values + index * 4);
+
+    return 0;
+}
+
+/* what the server would send for a window that selected StructureNotify */
+int X_headless_notify(struct X * x, struct X_Headless_resource * win, uint8_t code) {
+    unsigned char event[32];
+
+    if (! (win->event_mask & X_EVENT_StructureNotify)) {
         return 0;
     }
 
-    recv_len = recv(x->sock, (void *)err_resp, 32, 0);
-    if (recv_len < 0) {
-        perror("recv");
+    memset((void *)event, 0, sizeof(event));
+    *(uint8_t *)event = code;
+    *(uint16_t *)(event + 2) = x->seq;
+    *(uint32_t *)(event + 4) = win->id;
+    *(uint32_t *)(event + 8) = win->id;
+    switch (code) {
+    case 19: /* MapNotify */
+        *(uint8_t *)(event + 12) = win->override_redirect;
+        break;
+    case 22: /* ConfigureNotify */
+        *(uint32_t *)(event + 12) = win->prev_sibling;
+        *(int16_t *)(event + 16) = win->pos_x;
+        *(int16_t *)(event + 18) = win->pos_y;
+        *(uint16_t *)(event + 20) = win->width;
+        *(uint16_t *)(event + 22) = win->height;
+        *(uint16_t *)(event + 24) = win->border_width;
+        *(uint8_t *)(event + 26) = win->override_redirect;
+        break;
+    }
+
+    X_window_cache_update(x, event);
+
+    return X_stash_event(x, event);
+}
+
+int X_headless_create_window(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * win;
+    struct X_Headless_resource * parent;
+    uint32_t mask;
+    uint32_t value;
+
+    win = X_headless_add(x, *(uint32_t *)(req + 4), X_HEADLESS_WINDOW);
+    if (win == NULL) {
+        return -1;
+    }
+    win->parent = *(uint32_t *)(req + 8);
+    win->pos_x = *(int16_t *)(req + 12);
+    win->pos_y = *(int16_t *)(req + 14);
+    win->border_width = *(uint16_t *)(req + 20);
+    parent = X_headless_get(x, win->parent);
+    X_headless_link(x, win, parent != NULL ? parent->last_child : 0);
+
+    mask = *(uint32_t *)(req + 28);
+    if (X_headless_value(req + 32, mask, X_WIN_ATTR_BACKGROUND_PIXEL, &value) == 0) {
+        win->background = value;
+    }
+    if (X_headless_value(req + 32, mask, X_WIN_ATTR_OVERRIDE_REDIRECT, &value) == 0) {
+        win->override_redirect = value;
+    }
+    if (X_headless_value(req + 32, mask, X_WIN_ATTR_EVENT_MASK, &value) == 0) {
+        win->event_mask = value;
+    }
+
+    return X_headless_resize(win, *(uint16_t *)(req + 16), *(uint16_t *)(req + 18), win->background);
+}
+
+int X_headless_change_window_attributes(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * win;
+    uint32_t mask;
+    uint32_t value;
+
+    win = X_headless_get(x, *(uint32_t *)(req + 4));
+    if (win == NULL || win->type != X_HEADLESS_WINDOW) {
         return 0;
-    } else if (recv_len == 32) {
-        err_code = err_resp[1];
-        printf("Err: %i\n", err_code);
+    }
+
+    /* like the server, a new background shows on the next expose (here: resize) only */
+    mask = *(uint32_t *)(req + 8);
+    if (X_headless_value(req + 12, mask, X_WIN_ATTR_BACKGROUND_PIXEL, &value) == 0) {
+        win->background = value;
+    }
+    if (X_headless_value(req + 12, mask, X_WIN_ATTR_OVERRIDE_REDIRECT, &value) == 0) {
+        win->override_redirect = value;
+    }
+    if (X_headless_value(req + 12, mask, X_WIN_ATTR_EVENT_MASK, &value) == 0) {
+        win->event_mask = value;
+    }
+
+    return 0;
+}
+
+int X_headless_configure_window(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * win;
+    struct X_Headless_resource * parent;
+    struct X_Headless_resource * sibling;
+    uint32_t mask;
+    uint32_t value;
+    uint32_t sibling_id;
+    uint16_t width;
+    uint16_t height;
+
+    win = X_headless_get(x, *(uint32_t *)(req + 4));
+    if (win == NULL || win->type != X_HEADLESS_WINDOW || win == &x->headless_root) {
         return 0;
     }
 
-    req_field = req;
+    mask = *(uint16_t *)(req + 8);
+    if (X_headless_value(req + 12, mask, X_CONFIG_X, &value) == 0) {
+        win->pos_x = (int16_t)value;
+    }
+    if (X_headless_value(req + 12, mask, X_CONFIG_Y, &value) == 0) {
+        win->pos_y = (int16_t)value;
+    }
+    width = win->width;
+    height = win->height;
+    if (X_headless_value(req + 12, mask, X_CONFIG_WIDTH, &value) == 0) {
+        width = value;
+    }
+    if (X_headless_value(req + 12, mask, X_CONFIG_HEIGHT, &value) == 0) {
+        height = value;
+    }
+    if (X_headless_value(req + 12, mask, X_CONFIG_BORDER_WIDTH, &value) == 0) {
+        win->border_width = value;
+    }
+    if ((width != win->width || height != win->height)
+        && X_headless_resize(win, width, height, win->background) != 0) {
+        return -1;
+    }
+    parent = X_headless_get(x, win->parent);
+    if (parent != NULL && X_headless_value(req + 12, mask, X_CONFIG_STACK_MODE, &value) == 0) {
+        if (X_headless_value(req + 12, mask, X_CONFIG_SIBLING, &sibling_id) != 0) {
+            sibling_id = 0;
+        }
+        sibling = X_headless_get(x, sibling_id);
+        if (sibling != NULL && sibling->parent != win->parent) {
+            sibling = NULL;
+        }
+        if (sibling == win) {
+            sibling = NULL;
+        }
+        X_headless_unlink(x, win);
+        /* TopIf, BottomIf and Opposite depend on occlusion, taken here as always there */
+        switch (value) {
+        case 0: /* Above */
+            X_headless_link(x, win, sibling != NULL ? sibling->id : parent->last_child);
+            break;
+        case 1: /* Below */
+            X_headless_link(x, win, sibling != NULL ? sibling->prev_sibling : 0);
+            break;
+        case 3: /* BottomIf */
+            X_headless_link(x, win, 0);
+            break;
+        default: /* TopIf, Opposite */
+            X_headless_link(x, win, parent->last_child);
+            break;
+        }
+    }
 
-    *(uint8_t *)req_field = 8; /* MapWindow */
-    req_field += 1;
-    req_field += 1; /* unused */
-    *(uint16_t *)req_field = 2;
-    req_field += 2;
-    *(uint32_t *)req_field = wid;
-    req_field += 2;
+    return X_headless_notify(x, win, 22); /* ConfigureNotify */
+}
+
+int X_headless_map_window(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * win;
 
-    sent_len = send(x->sock, (void *)req, (req_field - req), 0);
-    if (sent_len != (req_field - req)) {
-        perror("send");
+    win = X_headless_get(x, *(uint32_t *)(req + 4));
+    if (win == NULL || win->type != X_HEADLESS_WINDOW || win->mapped) {
         return 0;
     }
+    win->mapped = 1;
 
-    return wid;
+    return X_headless_notify(x, win, 19); /* MapNotify */
+}
+
+int X_headless_create_pixmap(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * pixmap;
+
+    pixmap = X_headless_add(x, *(uint32_t *)(req + 4), X_HEADLESS_PIXMAP);
+    if (pixmap == NULL) {
+        return -1;
+    }
+
+    return X_headless_resize(pixmap, *(uint16_t *)(req + 12), *(uint16_t *)(req + 14), 0);
+}
+
+int X_headless_change_gc(struct X * x, unsigned char * req, int create) {
+    struct X_Headless_resource * gc;
+    uint32_t mask;
+    unsigned char * values;
+    uint32_t value;
+
+    if (create) {
+        gc = X_headless_add(x, *(uint32_t *)(req + 4), X_HEADLESS_GC);
+        mask = *(uint32_t *)(req + 12);
+        values = req + 16;
+    } else {
+        gc = X_headless_get(x, *(uint32_t *)(req + 4));
+        mask = *(uint32_t *)(req + 8);
+        values = req + 12;
+    }
+    if (gc == NULL || gc->type != X_HEADLESS_GC) {
+        return create ? -1 : 0;
+    }
+
+    if (X_headless_value(values, mask, 0x00000004, &value) == 0) { /* foreground */
+        gc->foreground = value;
+    }
+
+    return 0;
+}
+
+/* a window or pixmap that can be drawn to */
+struct X_Headless_resource * X_headless_drawable(struct X * x, X_id id) {
+    struct X_Headless_resource * res;
+
+    res = X_headless_get(x, id);
+    if (res == NULL || res->type == X_HEADLESS_GC || res->pixels == NULL) {
+        return NULL;
+    }
+
+    return res;
+}
+
+int X_headless_copy_area(struct X * x, unsigned char * req) {
+    struct X_Headless_resource * src;
+    struct X_Headless_resource * dst;
+    int32_t src_x;
+    int32_t src_y;
+    int32_t dst_x;
+    int32_t dst_y;
+    int32_t width;
+    int32_t height;
+
+    src = X_headless_drawable(x, *(uint32_t *)(req + 4));
+    dst = X_headless_drawable(x, *(uint32_t *)(req + 8));
+    if (src == NULL || dst == NULL) {
+        return 0;
+    }
+
+    src_x = *(int16_t *)(req + 16);
+    src_y = *(int16_t *)(req + 18);
+    dst_x = *(int16_t *)(req + 20);
+    dst_y = *(int16_t *)(req + 22);
+    width = *(uint16_t *)(req + 24);
+    height = *(uint16_t *)(req + 26);
+
+    if (! X_clip(&src_x, &src_y, &dst_x, &dst_y, &width, &height, src->width, src->height)
+        || ! X_clip(&dst_x, &dst_y, &src_x, &src_y, &width, &height, dst->width, dst->height)) {
+        return 0;
+    }
+
+    X_blit_pixels(
+        dst->pixels + dst_y * dst->width + dst_x, dst->width,
+        src->pixels + src_y * src->width + src_x, src->width,
+        width, height);
+
+    return 0;
+}
+
+int X_headless_fill_rects(struct X * x, unsigned char * req, size_t req_len) {
+    struct X_Headless_resource * dst;
+    struct X_Headless_resource * gc;
+    unsigned char * rect;
+    int32_t dst_x;
+    int32_t dst_y;
+    int32_t src_x = 0;
+    int32_t src_y = 0;
+    int32_t width;
+    int32_t height;
+
+    dst = X_headless_drawable(x, *(uint32_t *)(req + 4));
+    gc = X_headless_get(x, *(uint32_t *)(req + 8));
+    if (dst == NULL || gc == NULL || gc->type != X_HEADLESS_GC) {
+        return 0;
+    }
+
+    for (rect = req + 12; rect + 8 <= req + req_len; rect += 8) {
+        dst_x = *(int16_t *)rect;
+        dst_y = *(int16_t *)(rect + 2);
+        width = *(uint16_t *)(rect + 4);
+        height = *(uint16_t *)(rect + 6);
+        if (! X_clip(&dst_x, &dst_y, &src_x, &src_y, &width, &height, dst->width, dst->height)) {
+            continue;
+        }
+        X_fill_pixels(
+            dst->pixels + dst_y * dst->width + dst_x, dst->width, width, height, gc->foreground);
+    }
+
+    return 0;
+}
+
+int X_headless_put_image(struct X * x, unsigned char * req, size_t req_len) {
+    struct X_Headless_resource * dst;
+    uint16_t img_width;
+    uint16_t img_height;
+    int32_t src_x = 0;
+    int32_t src_y = 0;
+    int32_t dst_x;
+    int32_t dst_y;
+    int32_t width;
+    int32_t height;
+
+    dst = X_headless_drawable(x, *(uint32_t *)(req + 4));
+    if (dst == NULL) {
+        return 0;
+    }
+    if (*(uint8_t *)(req + 1) != 2 || *(uint8_t *)(req + 21) != x->screen_formats[0].depth) {
+        fputs("headless PutImage only takes ZPixmap at the root depth\n", stderr);
+        return 0;
+    }
+
+    img_width = *(uint16_t *)(req + 12);
+    img_height = *(uint16_t *)(req + 14);
+    if (24 + (size_t)img_width * img_height * 4 > req_len) {
+        fputs("Malformed PutImage\n", stderr);
+        return -1;
+    }
+
+    dst_x = *(int16_t *)(req + 16);
+    dst_y = *(int16_t *)(req + 18);
+    width = img_width;
+    height = img_height;
+    if (! X_clip(&dst_x, &dst_y, &src_x, &src_y, &width, &height, dst->width, dst->height)) {
+        return 0;
+    }
+
+    X_blit_pixels(
+        dst->pixels + dst_y * dst->width + dst_x, dst->width,
+        (uint32_t *)(req + 24) + src_y * img_width + src_x, img_width,
+        width, height);
+
+    return 0;
+}
+
+/* runs the queued requests against the framebuffer; requests with replies are not supported */
+int X_headless_execute(struct X * x, unsigned char * reqs, size_t reqs_len) {
+    unsigned char * req;
+    size_t req_len;
+    int res;
+
+    for (req = reqs; req < reqs + reqs_len; req += req_len) {
+        req_len = *(uint16_t *)(req + 2) * 4;
+        if (req_len < 4 || req + req_len > reqs + reqs_len) {
+            fputs("Malformed request\n", stderr);
+            return -1;
+        }
+
+        switch (*(uint8_t *)req) {
+        case 1: /* CreateWindow */
+            res = X_headless_create_window(x, req);
+            break;
+        case 2: /* ChangeWindowAttributes */
+            res = X_headless_change_window_attributes(x, req);
+            break;
+        case 8: /* MapWindow */
+            res = X_headless_map_window(x, req);
+            break;
+        case 12: /* ConfigureWindow */
+            res = X_headless_configure_window(x, req);
+            break;
+        case 53: /* CreatePixmap */
+            res = X_headless_create_pixmap(x, req);
+            break;
+        case 54: /* FreePixmap */
+        case 60: /* FreeGC */
+            X_headless_free(x, *(uint32_t *)(req + 4));
+            res = 0;
+            break;
+        case 55: /* CreateGC */
+            res = X_headless_change_gc(x, req, 1);
+            break;
+        case 56: /* ChangeGC */
+            res = X_headless_change_gc(x, req, 0);
+            break;
+        case 62: /* CopyArea */
+            res = X_headless_copy_area(x, req);
+            break;
+        case 70: /* PolyFillRectangle */
+            res = X_headless_fill_rects(x, req, req_len);
+            break;
+        case 72: /* PutImage */
+            res = X_headless_put_image(x, req, req_len);
+            break;
+        default:
+            fprintf(stderr, "Request not supported headless: '%u'\n", *(uint8_t *)req);
+            res = 0;
+            break;
+        }
+        if (res != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+Paints win and its mapped descendants onto the screen, parents before their children and
+siblings bottom-to-top. (org_x, org_y) is where the inside of the parent is on the root
+and clip_* what shows of it; borders are not drawn.
+*/
+void X_headless_composite(
+    struct X * x, struct X_Headless_resource * win, int32_t org_x, int32_t org_y,
+    int32_t clip_x0, int32_t clip_y0, int32_t clip_x1, int32_t clip_y1
+) {
+    struct X_Headless_resource * child;
+
+    /* the position is that of the outer corner of the border */
+    org_x += win->pos_x + win->border_width;
+    org_y += win->pos_y + win->border_width;
+    if (clip_x0 < org_x) {
+        clip_x0 = org_x;
+    }
+    if (clip_y0 < org_y) {
+        clip_y0 = org_y;
+    }
+    if (clip_x1 > org_x + win->width) {
+        clip_x1 = org_x + win->width;
+    }
+    if (clip_y1 > org_y + win->height) {
+        clip_y1 = org_y + win->height;
+    }
+    if (clip_x0 >= clip_x1 || clip_y0 >= clip_y1) {
+        /* the children are clipped by win, so none of them shows either */
+        return;
+    }
+
+    X_blit_pixels(
+        x->headless_screen + clip_y0 * x->headless_root.width + clip_x0, x->headless_root.width,
+        win->pixels + (clip_y0 - org_y) * win->width + (clip_x0 - org_x), win->width,
+        clip_x1 - clip_x0, clip_y1 - clip_y0);
+
+    for (child = X_headless_get(x, win->first_child); child != NULL;
+         child = X_headless_get(x, child->next_sibling)) {
+        if (child->mapped) {
+            X_headless_composite(x, child, org_x, org_y, clip_x0, clip_y0, clip_x1, clip_y1);
+        }
+    }
+}
+
+/*
+Returns the pixels of a window or pixmap, width pixels per row, as 0x00RRGGBB.
+For the root window this is the screen: the mapped windows composited over the root
+in stacking order.
+*/
+uint32_t * X_headless_pixels(struct X * x, X_id drawable, uint16_t * width, uint16_t * height) {
+    struct X_Headless_resource * res;
+    struct X_Headless_resource * root;
+
+    if (X_flush(x) != 0) {
+        return NULL;
+    }
+
+    res = X_headless_drawable(x, drawable);
+    if (res == NULL) {
+        return NULL;
+    }
+    *width = res->width;
+    *height = res->height;
+
+    root = &x->headless_root;
+    if (res != root) {
+        return res->pixels;
+    }
+
+    X_headless_composite(x, root, 0, 0, 0, 0, root->width, root->height);
+
+    return x->headless_screen;
 }
+#endif
 
 void X_destroy_window(struct X * x, X_id id) {
     if (x == NULL) {
@@ -812,8 +4787,24 @@ void X_destroy_window(struct X * x, X_id id) {
 
 int main(void) {
     struct X * x = make_X();
+    struct X_Rect rect;
+    struct X_Value_list values;
+    X_id win;
+
+    if (x == NULL) {
+        return 1;
+    }
+
+    rect.pos_x = 10;
+    rect.pos_y = 10;
+    rect.width = 100;
+    rect.height = 100;
+
+    X_value_list_init(&values);
+    X_value_list_set(&values, X_WIN_ATTR_BACKGROUND_PIXEL, X_rgb(x, 255, 128, 64));
+    X_value_list_set(&values, X_WIN_ATTR_EVENT_MASK, X_EVENT_StructureNotify);
 
-    X_id win = X_create_window(x);
+    win = X_create_window(x, x->root_wid, &rect, 1, &values, NULL);
 
     X_destroy_window(x, win);
     X_destroy(x);